@@ -0,0 +1,62 @@
+#!/bin/sh
+# Generate the synthetic benchmark trees under ROOT. Names and layout are
+# fixed for a given SCALE, so every run lists exactly the same trees.
+#
+#   flat/   one huge directory               (100000 * SCALE files)
+#   deep/   narrow chains                    (4 chains, 500 * SCALE levels)
+#   wide/   shallow fan-out                  (1000 * SCALE dirs x 20 files)
+#   mixed/  file types, modes and symlinks   (200 * SCALE dirs x 25 entries)
+#
+# Usage: gen_tree.sh ROOT [SCALE]
+set -e
+
+ROOT=${1:?usage: gen_tree.sh ROOT [SCALE]}
+SCALE=${2:-1}
+STAMP="$ROOT/.generated-scale-$SCALE"
+
+if [ -f "$STAMP" ]; then
+    echo "bench: reusing trees in $ROOT (scale $SCALE)"
+    exit 0
+fi
+
+echo "bench: generating trees in $ROOT (scale $SCALE)"
+rm -rf "$ROOT"
+mkdir -p "$ROOT/flat" "$ROOT/deep" "$ROOT/wide" "$ROOT/mixed"
+
+# flat: names of varying length sharing long prefixes
+(cd "$ROOT/flat" && seq 1 $((100000 * SCALE)) | awk '{
+    printf "file_%07d%s\n", $1, ($1 % 3 == 0) ? ".dat" : ($1 % 3 == 1) ? "_a_longer_name.txt" : ""
+}' | xargs touch)
+
+# deep: a few long chains of single subdirectories
+for c in 1 2 3 4; do
+    d="$ROOT/deep/chain$c"
+    mkdir -p "$d"
+    (cd "$d" && i=0 && while [ $i -lt $((500 * SCALE)) ]; do
+        mkdir level && touch level.txt && cd level
+        i=$((i + 1))
+    done)
+done
+
+# wide: many shallow directories with a handful of files each
+(cd "$ROOT/wide" && seq 1 $((1000 * SCALE)) | awk '{ printf "dir%05d\n", $1 }' | xargs mkdir)
+for d in "$ROOT"/wide/dir*; do
+    (cd "$d" && touch f01 f02 f03 f04 f05 f06 f07 f08 f09 f10 \
+                      f11 f12 f13 f14 f15 f16 f17 f18 f19 f20)
+done
+
+# mixed: regular, executable, archive, fifo, subdir and (dangling) symlinks
+i=0
+while [ $i -lt $((200 * SCALE)) ]; do
+    d=$(printf "%s/mixed/m%04d" "$ROOT" $i)
+    mkdir -p "$d/sub"
+    (cd "$d" && touch a.txt b.c c.h data.tar data.tar.gz pack.zip img.tgz \
+                      notes.md report.pdf e1 e2 e3 sub/inner \
+          && chmod +x e1 e2 e3 && mkfifo pipe \
+          && ln -s a.txt link_file && ln -s sub link_dir && ln -s missing link_dangling \
+          && ln a.txt hardlink && touch .hidden1 .hidden2 \
+          && dd if=/dev/zero of=blob bs=1k count=$((i % 64 + 1)) 2>/dev/null)
+    i=$((i + 1))
+done
+
+touch "$STAMP"
@@ -0,0 +1,91 @@
+#!/bin/sh
+# Time every listing mode of every given ls binary against the benchmark
+# trees, with a hot page cache and, when we are allowed to drop it, a cold
+# one. Reports wall time (best of BENCH_RUNS), peak RSS and, when strace is
+# installed, the number of syscalls.
+#
+# Usage: run.sh ROOT LS_BINARY...
+# Results are printed as a table and written to $BENCH_OUT as CSV.
+
+ROOT=${1:?usage: run.sh ROOT LS_BINARY...}
+shift
+HERE=$(dirname "$0")
+RUNSTAT="$HERE/runstat"
+RUNS=${BENCH_RUNS:-3}
+OUT=${BENCH_OUT:-$HERE/results.csv}
+
+drop_caches()
+{
+    sync
+    echo 3 > /proc/sys/vm/drop_caches 2>/dev/null
+}
+
+can_drop=0
+if drop_caches; then can_drop=1; fi
+if [ $can_drop -eq 0 ]; then
+    echo "bench: cannot write /proc/sys/vm/drop_caches, skipping cold-cache runs"
+fi
+
+have_strace=0
+if command -v strace > /dev/null 2>&1; then have_strace=1; fi
+
+# Count syscalls of one run (whole process tree)
+count_syscalls()
+{
+    if [ $have_strace -eq 0 ]; then echo "n/a"; return; fi
+    tmp=$(mktemp)
+    strace -f -c -o "$tmp" "$@" > /dev/null 2>&1
+    calls=$(awk '$NF == "total" { print $4 }' "$tmp")
+    rm -f "$tmp"
+    echo "${calls:-n/a}"
+}
+
+echo "binary,tree,mode,cache,wall_s,max_rss_kb,syscalls" > "$OUT"
+printf "%-14s %-6s %-5s %-5s %10s %12s %10s\n" binary tree mode cache wall_s max_rss_kb syscalls
+
+for bin in "$@"; do
+    name=$(basename "$bin")
+    [ "$bin" = "$(command -v ls)" ] && name="system-ls"
+    for tree in flat deep wide mixed; do
+        for mode in plain -l -x -R -lR; do
+            flags=$mode
+            [ "$mode" = plain ] && flags=
+            for cache in hot cold; do
+                if [ $cache = cold ]; then
+                    [ $can_drop -eq 1 ] || continue
+                    drop_caches
+                    set -- $("$RUNSTAT" "$bin" $flags "$ROOT/$tree")
+                else
+                    # Warm up once, then keep the best of $RUNS runs
+                    "$RUNSTAT" "$bin" $flags "$ROOT/$tree" > /dev/null
+                    best=
+                    r=0
+                    while [ $r -lt "$RUNS" ]; do
+                        set -- $("$RUNSTAT" "$bin" $flags "$ROOT/$tree")
+                        if [ -z "$best" ] || awk "BEGIN { exit !($1 < $best) }"; then
+                            best=$1
+                            rss=$2
+                            status=$3
+                        fi
+                        r=$((r + 1))
+                    done
+                    set -- "$best" "$rss" "$status"
+                fi
+
+                # Generations that predate a flag reject it with a usage error
+                if [ "$3" -ne 0 ]; then
+                    wall="n/a"; rss="n/a"; calls="n/a"
+                else
+                    wall=$1; rss=$2
+                    calls=$(count_syscalls "$bin" $flags "$ROOT/$tree")
+                fi
+
+                printf "%-14s %-6s %-5s %-5s %10s %12s %10s\n" \
+                       "$name" "$tree" "$mode" "$cache" "$wall" "$rss" "$calls"
+                echo "$name,$tree,$mode,$cache,$wall,$rss,$calls" >> "$OUT"
+            done
+        done
+    done
+done
+
+echo "bench: results written to $OUT"
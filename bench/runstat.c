@@ -0,0 +1,55 @@
+/* runstat: run a command with stdout discarded and report its wall time,
+ * peak RSS and exit status on one line: "<seconds> <max_rss_kb> <status>" */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: %s command [args...]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    pid_t pid = fork();
+    if (pid == -1)
+    {
+        perror("fork");
+        exit(EXIT_FAILURE);
+    }
+    if (pid == 0)
+    {
+        int fd = open("/dev/null", O_WRONLY);
+        if (fd != -1)
+        {
+            dup2(fd, STDOUT_FILENO);
+            dup2(fd, STDERR_FILENO);
+            close(fd);
+        }
+        execvp(argv[1], &argv[1]);
+        _exit(127);
+    }
+
+    int status;
+    struct rusage ru;
+    if (wait4(pid, &status, 0, &ru) == -1)
+    {
+        perror("wait4");
+        exit(EXIT_FAILURE);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    int code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    printf("%.4f %ld %d\n", secs, ru.ru_maxrss, code);
+    return 0;
+}
@@ -0,0 +1,19 @@
+#!/bin/sh
+# Profile-training workload for make pgo: run an instrumented ls over the
+# benchmark trees in the modes the benchmark measures, plus the unsorted,
+# threaded and io_uring paths, so every hot loop gets a profile.
+#
+# Usage: train.sh ROOT LS_BINARY
+set -e
+
+ROOT=${1:?usage: train.sh ROOT LS_BINARY}
+LS=${2:?usage: train.sh ROOT LS_BINARY}
+
+for tree in flat deep wide mixed; do
+    for args in "" "-l" "-x" "-R" "-lR" "-U" "-lU" "-R -j4" "-l --uring" \
+                "--color=always" "-l --color=always"; do
+        # shellcheck disable=SC2086
+        "$LS" $args "$ROOT/$tree" > /dev/null
+    done
+done
+echo "pgo: trained $LS on $ROOT"
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -6,37 +7,636 @@
 #include <errno.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/resource.h>
 #include <pwd.h>
 #include <grp.h>
 #include <time.h>
 #include <limits.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <locale.h>
+#include <wchar.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <signal.h>
+#include <endian.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* Build with -DNO_URING (make URING=0) to leave the io_uring engine out */
+#if !defined(NO_URING) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_URING 1
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#endif
+#endif
 
 extern int errno;
 
 /* ---------- ANSI color codes ---------- */
 #define ANSI_RESET    "\033[0m"
-#define ANSI_BLUE     "\033[0;34m"
-#define ANSI_GREEN    "\033[0;32m"
-#define ANSI_RED      "\033[0;31m"
-#define ANSI_MAGENTA  "\033[0;35m"
-#define ANSI_REVERSE  "\033[7m"
 
+/* The palette used when LS_COLORS is not set, in LS_COLORS syntax */
+#define DEFAULT_COLORS "di=0;34:ln=0;35:pi=7:so=7:bd=7:cd=7:ex=0;32:" \
+                       "*.tar=0;31:*.gz=0;31:*.zip=0;31:*.tgz=0;31"
+
+/* Everything the listings print about one entry, captured in a single
+ * metadata pass so rendering never has to stat again. */
 typedef struct {
     char *name;
+    size_t name_len;        /* bytes */
+    int name_width;         /* terminal columns */
+    unsigned short color;   /* index into color_seqs, 0 for uncolored */
     mode_t mode;
     off_t size;
     int is_symlink;
+    nlink_t nlink;
+    uid_t uid;
+    gid_t gid;
+    time_t mtime;
+    time_t ctime;
+    time_t atime;
+    uint32_t mtime_nsec, ctime_nsec, atime_nsec;   /* -t breaks same-second ties */
+    ino_t ino;
+    blkcnt_t blocks;
 } FileEntry;
 
+/* ---------- Column layout ---------- */
+#define COL_GAP         2
+#define COL_MIN_WIDTH   (1 + COL_GAP)   /* one-character name plus the gap */
+
+/* Running state of one candidate column count during layout */
+typedef struct {
+    int valid;
+    size_t line_len;
+    size_t *col_arr;
+} ColumnInfo;
+
+/* ---------- Timestamp formatter ---------- */
+#define SIX_MONTHS      (31556952 / 2)  /* half a Gregorian year, as GNU ls */
+#define TIME_SLOTS      16
+#define TIME_LEN        12              /* "Oct 16 08:54" or "Oct 16  2025" */
+
+/* One local calendar day with a constant UTC offset, and its date prefix */
+typedef struct {
+    time_t day_start;
+    time_t day_end;                     /* exclusive; 0 marks an empty slot */
+    char date[8];                       /* "Oct 16 " */
+    char year[6];                       /* " 2025" */
+} TimeSlot;
+
+/* Per-thread cache: days are looked up by slot, and only hour and
+ * minute are computed for each file. Slots are indexed by local day
+ * number, taken with the UTC offset of the last day filled. */
+typedef struct {
+    time_t now;
+    long gmtoff;
+    TimeSlot slots[TIME_SLOTS];
+} TimeCache;
+
+static __thread TimeCache time_cache;
+
+/* ---------- Output writer ---------- */
+#define OUTBUF_SIZE (256 * 1024)
+
+/* Byte buffer that every renderer writes into. An fd-backed writer is
+ * flushed in OUTBUF_SIZE blocks (per line on a tty); a memory writer
+ * (fd == -1) just grows and is used for the per-directory -j buffers. */
+typedef struct {
+    char *buf;
+    size_t len;
+    size_t cap;
+    int fd;
+    int line_buffered;
+} OutBuf;
+
+static OutBuf out_stdout;
+
+/* ---------- Arena allocator ---------- */
+#define ARENA_CHUNK (256 * 1024)
+
+typedef struct ArenaChunk {
+    struct ArenaChunk *next;
+    size_t size;
+    size_t used;
+    char data[];
+} ArenaChunk;
+
+/* Bump allocator. Memory is handed back in bulk by rewinding to a mark,
+ * and chunks are kept for the next directory instead of being freed. */
+typedef struct {
+    ArenaChunk *first;
+    ArenaChunk *cur;
+} Arena;
+
+typedef struct {
+    ArenaChunk *chunk;
+    size_t used;
+} ArenaMark;
+
+/* Names and FileEntry arrays of the directories being listed by this
+ * thread. Entry arrays live in their own arena so the array being
+ * filled is always the top allocation and can grow in place. */
+static __thread Arena name_arena, entry_arena;
+
+/* ---------- Name sort engine ---------- */
+#define SORT_SMALL          64          /* below this, plain qsort wins */
+#define SORT_INSERTION      24          /* runs this short are finished by insertion */
+#define SORT_PARALLEL_MIN   (256 * 1024)
+#define SORT_THREADS_MAX    16
+
+/* Eight name bytes starting at the current depth, big-endian so integer
+ * order equals strcmp order, paired with the entry's index. The -S, -t
+ * and -X orders reuse it with a packed size, time or extension key. */
+typedef struct {
+    uint64_t key;
+    uint32_t idx;
+} SortKey;
+
+/* -S, -t and -X pick the order; -c and -u pick the time -t sorts by and
+ * -l shows */
+enum { SORT_NAME, SORT_SIZE, SORT_TIME, SORT_EXT };
+enum { TIME_MTIME, TIME_CTIME, TIME_ATIME };
+
+static int sort_mode = SORT_NAME;
+static int time_field = TIME_MTIME;
+static int reverse_flag;
+static unsigned int sort_mask;  /* statx fields the order needs beyond the listing's */
+
+/* Entries of the directory being read, plus the per-batch stat scratch */
+typedef struct {
+    FileEntry *entries;
+    size_t count;
+    size_t cap;
+    size_t *pending;        /* indices waiting for stat_batch() */
+    int *ok;
+    size_t pcap;
+} EntryList;
+
+/* Heap-owned names of the subdirectories to descend into */
+typedef struct {
+    char **names;
+    size_t count;
+    size_t cap;
+} NameList;
+
+/* ---------- Listing cache ---------- */
+#define CACHE_MAGIC         0x3143534cu         /* "LSC1" */
+#define CACHE_VERSION       3
+#define CACHE_MAX_AGE       3600                /* seconds a snapshot is trusted */
+#define CACHE_RACY          1                   /* see cache_load() */
+#define CACHE_FILE_MAX      (64 * 1024 * 1024)
+#define CACHE_MAX_BYTES     (512ull * 1024 * 1024)
+#define CACHE_GC_INTERVAL   60
+
+/* What the snapshot was taken with; a listing only reuses its own kind */
+#define CACHE_F_LONG        1
+#define CACHE_F_ALL         2
+#define CACHE_F_COLOR       4
+
+/* One snapshot file: header, `count` records, then the names, each
+ * NUL-terminated, in record order. Native byte order; the file is only
+ * read back on the machine that wrote it. */
+typedef struct {
+    uint32_t magic, version, flags;
+    uint32_t mask;          /* statx fields the records hold; must cover the reader's */
+    uint64_t dev, ino;
+    int64_t mtime_sec, mtime_nsec, ctime_sec, ctime_nsec;
+    int64_t written;
+    uint64_t count, names_len, checksum;
+} CacheHeader;
+
+typedef struct {
+    int64_t size, mtime, ctime, blocks;
+    uint64_t nlink;
+    uint32_t mode, uid, gid, name_len;
+    uint32_t mtime_nsec, ctime_nsec;
+} CacheRecord;
+
+/* --cache[=DIR]: NULL when the cache is off */
+static char *cache_dir;
+
+/* ---------- Serial -R walk ---------- */
+#define WALK_FDS_MAX 256    /* ancestor descriptors kept open at once */
+
+/* ---------- Disk usage ---------- */
+/* --du: what a directory and everything below it takes up */
+typedef struct {
+    uint64_t blocks;        /* 512-byte units, as st_blocks */
+    uint64_t bytes;         /* apparent size */
+    dev_t dev;              /* device the directory's entries live on */
+} DuTotal;
+
+/* A multiply-linked file already counted */
+typedef struct {
+    uint64_t dev, ino;
+} InodeKey;
+
+static int du_flag;
+/* Open addressing, ino 0 marks an empty slot. Only files with more than
+ * one link ever go in, so it stays small on most trees. */
+static InodeKey *du_seen;
+static size_t du_seen_cap, du_seen_count;
+
+/* One directory on the explicit -R stack. Its entries are gone by the
+ * time it is pushed; only the subdirectories still to visit remain. */
+typedef struct {
+    int fd;                 /* -1 once evicted to stay under the fd cap */
+    size_t path_len;        /* length of its display path in Walk.path */
+    dev_t dev;              /* identity recorded on eviction, checked */
+    ino_t ino;              /* when the descriptor is reopened */
+    NameList subdirs;
+    size_t next;
+    DuTotal du;             /* --du: its own entries plus the finished subdirectories */
+} WalkFrame;
+
+typedef struct {
+    WalkFrame *frames;
+    size_t depth, cap;
+    size_t lowest_open;     /* frames below this index hold no descriptor */
+    size_t nopen;
+    size_t max_fds;
+    char *path;             /* display path of the directory being listed */
+    size_t path_cap;
+} Walk;
+
+/* ---------- Record formats ---------- */
+/* --format: text is the human listing; ndjson and binary print one
+ * record per entry with the raw FileEntry fields */
+enum { FMT_TEXT, FMT_NDJSON, FMT_BINARY };
+
+#define REC_DIR     1       /* starts a directory; the name is its path */
+#define REC_ENTRY   2
+
+/* One --format=binary record, little-endian, followed by its name bytes
+ * (not NUL-terminated). Directory records leave the fields zero. */
+typedef struct {
+    uint32_t len;           /* bytes in the record, this header and the name included */
+    uint32_t type;
+    uint32_t mode, uid, gid, reserved;
+    uint64_t nlink;
+    int64_t size, blocks, mtime, ctime;
+} BinRecord;
+
+static int out_format = FMT_TEXT;
+
+/* ---------- Watch mode ---------- */
+#define WATCH_EVENTS    (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | \
+                         IN_DELETE_SELF | IN_ONLYDIR | IN_EXCL_UNLINK)
+#define WATCH_EVBUF     (64 * 1024)
+#define WATCH_IDLE_MS   1000    /* how often idle roots are checked for removal */
+
+/* The entries of one watched directory, keyed by name. Entries and
+ * names are heap-owned: they outlive the listing that first read them. */
+typedef struct {
+    FileEntry **slots;      /* open addressing, NULL marks an empty slot */
+    size_t cap;             /* power of two */
+    size_t count;
+} EntrySet;
+
+typedef struct {
+    int wd;                 /* -1 once the directory is no longer watched */
+    int fd;                 /* entries are re-stat'ed through it */
+    int root;               /* which command-line directory it is under */
+    int is_root;            /* it is that directory itself */
+    char *path;             /* display path */
+    EntrySet set;
+} WatchDir;
+
+/* Every watched directory of a --watch run. Directories are never moved
+ * once added, so by_wd can map an event straight to its directory. */
+typedef struct {
+    int ifd;
+    WatchDir *dirs;
+    size_t ndirs, cap;
+    size_t nlive;           /* dirs still watched */
+    size_t *by_wd;          /* watch descriptor -> dirs index + 1, 0 if none */
+    size_t nwd;
+    int long_flag, horizontal_flag, recursive_flag;
+    int tty;
+    int row_mode;           /* one name-ordered -l/-1 listing that fits the screen: patch rows in place */
+    int screen_rows;
+    int dirty;              /* the tty listing needs a full redraw */
+} Watcher;
+
+static int watch_flag;
+/* Set by SIGWINCH while a tty is watched: reflow at the new width */
+static volatile sig_atomic_t watch_resized;
+
+/* ---------- Batched directory reader ---------- */
+#define DIRBUF_DEFAULT (256 * 1024)
+#define DIRBUF_MIN     (32 * 1024)
+#define DIRBUF_MAX     (16 * 1024 * 1024)
+
+/* Record layout returned by the getdents64 syscall */
+struct linux_dirent64 {
+    ino64_t        d_ino;
+    off64_t        d_off;
+    unsigned short d_reclen;
+    unsigned char  d_type;
+    char           d_name[];
+};
+
+typedef struct {
+    int fd;
+    char *buf;
+    size_t bufsize;
+    size_t len;     /* bytes returned by the last getdents64 call */
+    size_t pos;     /* cursor inside the current batch */
+} DirReader;
+
+static size_t dirbuf_size = DIRBUF_DEFAULT;
+
+/* ---------- Metadata backend ---------- */
+/* Fields needed to pick a color in the short and -x listings */
+#define META_MASK_SHORT (STATX_TYPE | STATX_MODE)
+/* Fields rendered by -l */
+#define META_MASK_LONG  (STATX_TYPE | STATX_MODE | STATX_NLINK | STATX_UID | \
+                         STATX_GID | STATX_MTIME | STATX_SIZE | STATX_BLOCKS)
+
+static int meta_flags = AT_SYMLINK_NOFOLLOW;
+static int have_statx = 1;
+
+/* ---------- io_uring stat engine ---------- */
+#define RING_ENTRIES 256
+
+#ifdef HAVE_URING
+/* Set by --uring; cleared for good if the kernel refuses a ring */
+static int use_uring;
+
+/* A raw io_uring used only for IORING_OP_STATX, one per thread */
+typedef struct {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_len, cq_len, sqes_len;
+    unsigned inflight;      /* submitted STATX ops whose completion is not reaped */
+    struct statx results[RING_ENTRIES];
+} StatRing;
+
+static __thread StatRing *stat_ring;
+#endif
+
+/* ---------- uid/gid name cache ---------- */
+/* Open-addressing table of id -> name. A NULL name records a failed
+ * lookup so unknown ids are not sent to NSS again. */
+typedef struct {
+    unsigned int id;
+    int used;
+    char *name;
+} IdSlot;
+
+typedef struct {
+    IdSlot *slots;
+    size_t cap;     /* power of two */
+    size_t count;
+} IdCache;
+
+static IdCache uid_cache, gid_cache;
+static pthread_mutex_t idcache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Set when the locale can encode multibyte names; otherwise every byte
+ * of a name is one column */
+static int multibyte_locale;
+
+/* Colors are used for --color=always, or for --color=auto on a tty */
+static int color_enabled;
+
+/* ---------- LS_COLORS classifier ---------- */
+/* File type keys understood in LS_COLORS; "*.ext" keys go to the
+ * extension table */
+enum { TC_DI, TC_LN, TC_PI, TC_SO, TC_BD, TC_CD, TC_EX, TC_FI, TC_COUNT };
+
+#define EXT_MAX     15          /* longer extensions are never colored */
+#define COLORS_MAX  65535
+
+/* Open-addressing slot keyed on a lowercased extension without the dot */
+typedef struct {
+    char ext[EXT_MAX + 1];
+    unsigned char len;          /* 0 marks an empty slot */
+    unsigned short color;
+} ExtSlot;
+
+/* Parsed once at startup, read-only afterwards, so workers share it */
+static char **color_seqs;       /* full escape sequences; [0] is unused */
+static size_t ncolor_seqs;
+static unsigned short type_color[TC_COUNT];
+static ExtSlot *ext_table;
+static size_t ext_cap;          /* power of two */
+static int ext_multi_dot;       /* some key is a multi-dot suffix like "tar.gz" */
+static int link_as_target;      /* ln=target: a symlink takes its target's color */
+static const char *color_reset = ANSI_RESET;
+
+/* -U/-f stream entries in directory order; -f also shows dot entries */
+static int unsorted_flag;
+static int show_all;
+static int one_per_line;
+
+/* ---------- Parallel -R ---------- */
+#define JOBS_MAX 256
+
+/* Descriptor of a listed directory, shared by the children that still
+ * have to openat() through it. The last child to open closes it. Idle
+ * handles are evicted like serial walk frames and reopened by path. */
+typedef struct DirHandle {
+    int fd;                 /* -1 while evicted */
+    int refs;               /* children that have not opened yet */
+    int busy;               /* children opening through fd right now */
+    dev_t dev;              /* identity, recorded on eviction */
+    ino_t ino;
+    const char *path;       /* the owning task's path, which outlives it */
+    struct DirHandle *prev, *next;  /* open handles, oldest first */
+} DirHandle;
+
+/* One directory of a parallel -R walk. Workers fill `out`/`err`; the
+ * main thread emits finished tasks in the serial recursion order. */
+typedef struct DirTask {
+    DirHandle *parent;      /* NULL for the root, which opens from the cwd */
+    char *name;
+    char *path;
+    OutBuf out;
+    char *err;
+    struct DirTask **children;
+    size_t nchildren;
+    int done;
+} DirTask;
+
+/* Per-worker deque: the owner pushes and pops at the tail, idle workers
+ * steal the oldest task from the head. */
+typedef struct {
+    pthread_mutex_t lock;
+    DirTask **items;
+    size_t head, tail, cap;
+} TaskDeque;
+
+typedef struct {
+    TaskDeque *deques;
+    int nworkers;
+    pthread_mutex_t lock;
+    pthread_cond_t work_cv;     /* new work queued or walk finished */
+    pthread_cond_t done_cv;     /* a task finished */
+    size_t queued;              /* tasks sitting in deques */
+    size_t outstanding;         /* tasks queued or running */
+    pthread_mutex_t fd_lock;    /* guards every DirHandle and the list */
+    DirHandle *oldest, *newest;
+    size_t nopen, max_fds;
+    int long_flag;
+    int horizontal_flag;
+} TaskPool;
+
+typedef struct {
+    TaskPool *pool;
+    int id;
+} Worker;
+
+static int jobs = 1;
+
+/* ---------- --stats instrumentation ---------- */
+/* Phases are timed exclusively: entering a nested phase pauses the outer
+ * one, so the per-phase times add up to the time spent inside them. */
+enum { PH_READ, PH_STAT, PH_SORT, PH_RENDER, PH_WRITE, PH_COUNT };
+enum { SC_OPENAT, SC_GETDENTS, SC_STATX, SC_FSTATAT, SC_URING_ENTER,
+       SC_WRITE, SC_CLOSE, SC_NSS, SC_COUNT };
+
+#define HIST_BUCKETS        40      /* log2 nanoseconds, up to ~9 minutes */
+#define STATS_SLOWEST       10
+#define STATS_SLOWEST_MAX   1000
+
+typedef struct {
+    uint64_t ns;
+    char *path;
+} SlowDir;
+
+typedef struct {
+    uint64_t phase_ns[PH_COUNT];
+    uint64_t calls[SC_COUNT];
+    uint64_t hist_stat[HIST_BUCKETS];
+    uint64_t hist_open[HIST_BUCKETS];
+    SlowDir *slow;          /* slowest first */
+    size_t nslow, maxslow;
+    uint64_t start;
+} Stats;
+
+/* Every hook checks this first, so a run without --stats only pays a
+ * predictable branch per call site */
+static int stats_enabled;
+static Stats stats;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread int stats_phase = -1;
+static __thread uint64_t stats_phase_start;
+
 /* ---------- Function Prototypes ---------- */
 void mode_to_str(mode_t mode, char *str);
 int get_term_width(void);
-void display_horizontal(FileEntry entries[], int count);
-void display_vertical(FileEntry entries[], int count);
-void print_colored_padded(FileEntry *e, int col_width);
-int is_tarball(const char *name);
+void display_horizontal(OutBuf *out, FileEntry entries[], int count);
+void display_vertical(OutBuf *out, FileEntry entries[], int count);
+void print_colored_padded(OutBuf *out, FileEntry *e, int col_width);
+void print_long_entry(OutBuf *out, FileEntry *e);
+void print_dir_header(OutBuf *out, const char *path);
+void print_record(OutBuf *out, const FileEntry *e);
+void out_init_fd(OutBuf *o, int fd);
+void out_init_mem(OutBuf *o);
+void out_flush(OutBuf *o);
+void out_write(OutBuf *o, const char *s, size_t n);
+void out_str(OutBuf *o, const char *s);
+void out_putc(OutBuf *o, char c);
+void out_pad(OutBuf *o, int n);
+void out_num(OutBuf *o, long long v, int width);
+void out_free(OutBuf *o);
+void format_time(time_t t, char *buf);
+void entry_fill_stat(FileEntry *e, const struct stat *st);
+IdSlot *idcache_slot(IdCache *c, unsigned int id);
+void idcache_put(IdCache *c, unsigned int id, const char *name);
+const char *uid_name(uid_t uid);
+const char *gid_name(gid_t gid);
+void idcache_prewarm(void);
+void colors_init(void);
+unsigned short color_for_ext(const char *name, size_t len);
+void color_classify(FileEntry *e, int dirfd);
+int name_width(const char *s, size_t len);
 int cmp_entry(const void *a, const void *b);
+void sort_entries_by_name(FileEntry *entries, size_t count);
+void order_entries(FileEntry *entries, size_t count);
+size_t parse_size(const char *arg);
+int dir_open(DirReader *dr, int dirfd, const char *name);
+ssize_t dir_fill(DirReader *dr);
+struct linux_dirent64 *dir_next(DirReader *dr);
+void dir_close(DirReader *dr);
+unsigned int meta_mask_for(int long_flag);
+int meta_stat(int dirfd, const char *name, unsigned int mask, struct stat *st);
+void statx_to_stat(const struct statx *stx, struct stat *st);
+size_t stat_batch(int dirfd, FileEntry *entries, size_t *pending, size_t npending,
+                  unsigned int mask, int *ok);
+#ifdef HAVE_URING
+StatRing *ring_get(void);
+void ring_free(void);
+#endif
+int dtype_needs_stat(const struct linux_dirent64 *d, int long_flag, int ext_colored);
+void *arena_alloc(Arena *a, size_t n);
+void *arena_grow(Arena *a, void *p, size_t old_n, size_t new_n);
+char *arena_strdup(Arena *a, const char *s);
+char *arena_strndup(Arena *a, const char *s, size_t len);
+ArenaMark arena_mark(Arena *a);
+void arena_release(Arena *a, ArenaMark m);
+void arena_free(Arena *a);
+char *join_path(const char *dir, const char *name);
+int is_descendable(const FileEntry *e);
+void entry_list_init(EntryList *l);
+void entry_list_done(EntryList *l);
+void read_batch(DirReader *dr, int long_flag, EntryList *l);
+size_t read_entries(DirReader *dr, int long_flag, FileEntry **out);
+void name_list_add(NameList *nl, const char *name);
+void name_list_free(NameList *nl);
+void list_directory(DirReader *dr, OutBuf *out, int long_flag, int horizontal_flag,
+                    NameList *subdirs, DuTotal *du);
+void render_sorted(OutBuf *out, FileEntry *entries, size_t count, int long_flag, int horizontal_flag);
+void cache_init(const char *dir);
+int cache_load(int dirfd, const struct stat *dst, unsigned int flags, FileEntry **out, size_t *count);
+void cache_store(const struct stat *dst, unsigned int flags, const FileEntry *entries, size_t count);
+void cache_gc(void);
 void do_ls(const char *dir, int long_flag, int horizontal_flag, int recursive_flag);
+void do_ls_walk(const char *dir, int long_flag, int horizontal_flag, int recursive_flag);
+void walk_enter(Walk *w, int parent_fd, const char *name,
+                int long_flag, int horizontal_flag, int recursive_flag);
+void walk_pop(Walk *w);
+void du_begin(DuTotal *t, int fd);
+void du_add_entries(DuTotal *t, const FileEntry *entries, size_t count);
+void du_finish(const char *path, const DuTotal *t, DuTotal *parent);
+size_t walk_fd_limit(void);
+void walk_evict(Walk *w);
+int walk_reopen(Walk *w, size_t k, int child_fd);
+void watch_run(const char **dirs, int ndirs, int long_flag, int horizontal_flag, int recursive_flag);
+int watch_add(Watcher *w, int parent_fd, const char *name, const char *path, int root, int announce);
+void watch_tree(Watcher *w, int parent_fd, const char *name, const char *path, int root, int announce);
+void watch_refresh(Watcher *w, size_t di, const char *name);
+void watch_resync(Watcher *w);
+void watch_redraw(Watcher *w);
+void watch_event(Watcher *w, const struct inotify_event *ev);
+void do_ls_parallel(const char *dir, int long_flag, int horizontal_flag);
+void deque_push(TaskDeque *dq, DirTask *t);
+DirTask *deque_pop(TaskDeque *dq);
+DirTask *deque_steal(TaskDeque *dq);
+void pool_submit(TaskPool *pool, int self, DirTask *t);
+void run_task(TaskPool *pool, int self, DirTask *t);
+void *worker_main(void *arg);
+void emit_task(TaskPool *pool, DirTask *t);
+uint64_t stats_clock(void);
+int stats_enter(int phase);
+void stats_leave(int prev);
+void stats_count(int call, uint64_t n);
+void stats_latency(uint64_t *hist, uint64_t since, uint64_t n);
+void stats_dir(const char *path, uint64_t since);
+void stats_report(void);
 
 /* ---------- Main ---------- */
 int main(int argc, char const *argv[])
@@ -46,18 +646,171 @@ int main(int argc, char const *argv[])
     int recursive_flag = 0;
     int opt;
 
-    /* Parse -l, -x, and -R */
-    while ((opt = getopt(argc, (char * const *)argv, "lxR")) != -1)
+    const char *color_when = "auto";
+    int prewarm_ids = 0;
+
+    enum { OPT_DIRBUF = 256, OPT_DONT_SYNC, OPT_COLOR, OPT_PREWARM_IDS, OPT_URING, OPT_STATS,
+           OPT_CACHE, OPT_WATCH, OPT_FORMAT, OPT_DU };
+    static const struct option long_opts[] = {
+        { "dirbuf", required_argument, NULL, OPT_DIRBUF },
+        { "dont-sync", no_argument, NULL, OPT_DONT_SYNC },
+        { "color", optional_argument, NULL, OPT_COLOR },
+        { "prewarm-ids", no_argument, NULL, OPT_PREWARM_IDS },
+        { "uring", no_argument, NULL, OPT_URING },
+        { "stats", optional_argument, NULL, OPT_STATS },
+        { "cache", optional_argument, NULL, OPT_CACHE },
+        { "watch", no_argument, NULL, OPT_WATCH },
+        { "format", required_argument, NULL, OPT_FORMAT },
+        { "du", no_argument, NULL, OPT_DU },
+        { NULL, 0, NULL, 0 }
+    };
+
+    /* Parse -l, -x, -R and long options */
+    while ((opt = getopt_long(argc, (char * const *)argv, "lxRj:Uf1StcuXr", long_opts, NULL)) != -1)
     {
         switch (opt)
         {
         case 'l': long_flag = 1; break;
         case 'x': horizontal_flag = 1; break;
         case 'R': recursive_flag = 1; break;
+        case 'U': unsorted_flag = 1; break;
+        case 'f': unsorted_flag = show_all = 1; color_when = "never"; break;
+        case '1': one_per_line = 1; break;
+        case 'S': sort_mode = SORT_SIZE; break;
+        case 't': sort_mode = SORT_TIME; break;
+        case 'X': sort_mode = SORT_EXT; break;
+        case 'c': time_field = TIME_CTIME; break;
+        case 'u': time_field = TIME_ATIME; break;
+        case 'r': reverse_flag = 1; break;
+        case 'j':
+            jobs = atoi(optarg);
+            if (jobs < 1 || jobs > JOBS_MAX)
+            {
+                fprintf(stderr, "Invalid -j value: %s (1-%d)\n", optarg, JOBS_MAX);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case OPT_DIRBUF:
+            dirbuf_size = parse_size(optarg);
+            if (dirbuf_size == 0)
+            {
+                fprintf(stderr, "Invalid --dirbuf size: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            if (dirbuf_size < DIRBUF_MIN) dirbuf_size = DIRBUF_MIN;
+            if (dirbuf_size > DIRBUF_MAX) dirbuf_size = DIRBUF_MAX;
+            break;
+        case OPT_DONT_SYNC: meta_flags |= AT_STATX_DONT_SYNC; break;
+        case OPT_COLOR: color_when = optarg ? optarg : "always"; break;
+        case OPT_PREWARM_IDS: prewarm_ids = 1; break;
+        case OPT_URING:
+#ifdef HAVE_URING
+            use_uring = 1;
+#else
+            fprintf(stderr, "%s: built without io_uring, using synchronous stat\n", argv[0]);
+#endif
+            break;
+        case OPT_STATS:
+            stats_enabled = 1;
+            stats.maxslow = STATS_SLOWEST;
+            if (optarg)
+            {
+                int n = atoi(optarg);
+                if (n < 1 || n > STATS_SLOWEST_MAX)
+                {
+                    fprintf(stderr, "Invalid --stats value: %s (1-%d)\n", optarg, STATS_SLOWEST_MAX);
+                    exit(EXIT_FAILURE);
+                }
+                stats.maxslow = (size_t)n;
+            }
+            break;
+        case OPT_CACHE: cache_init(optarg); break;
+        case OPT_WATCH: watch_flag = 1; break;
+        case OPT_DU: du_flag = 1; break;
+        case OPT_FORMAT:
+            if (strcmp(optarg, "text") == 0) out_format = FMT_TEXT;
+            else if (strcmp(optarg, "ndjson") == 0) out_format = FMT_NDJSON;
+            else if (strcmp(optarg, "binary") == 0) out_format = FMT_BINARY;
+            else
+            {
+                fprintf(stderr, "Invalid --format argument: %s (use text, ndjson or binary)\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
         default:
-            fprintf(stderr, "Usage: %s [-l] [-x] [-R] [dir...]\n", argv[0]);
+            fprintf(stderr, "Usage: %s [-l] [-x] [-R] [-U] [-f] [-1] [-S|-t|-X] [-c|-u] [-r] [-j N]"
+                    " [--dirbuf=SIZE] [--dont-sync]"
+                    " [--color[=WHEN]] [--prewarm-ids] [--uring] [--stats[=N]]"
+                    " [--cache[=DIR]] [--watch] [--format=FMT] [--du] [dir...]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (strcmp(color_when, "always") == 0) color_enabled = 1;
+    else if (strcmp(color_when, "never") == 0) color_enabled = 0;
+    else if (strcmp(color_when, "auto") == 0) color_enabled = isatty(STDOUT_FILENO);
+    else
+    {
+        fprintf(stderr, "Invalid --color argument: %s (use always, never or auto)\n", color_when);
+        exit(EXIT_FAILURE);
+    }
+    if (du_flag)
+    {
+        if (watch_flag || out_format != FMT_TEXT)
+        {
+            fprintf(stderr, "--du cannot be combined with --watch or --format\n");
+            exit(EXIT_FAILURE);
+        }
+        /* Totals need every entry, dot files too, with its size, blocks
+         * and links, in a sorted walk */
+        recursive_flag = 1;
+        long_flag = 1;
+        show_all = 1;
+        unsorted_flag = 0;
+        color_enabled = 0;
+        prewarm_ids = 0;
+    }
+    if (out_format != FMT_TEXT)
+    {
+        if (watch_flag)
+        {
+            fprintf(stderr, "--format=%s cannot be combined with --watch\n",
+                    out_format == FMT_NDJSON ? "ndjson" : "binary");
             exit(EXIT_FAILURE);
         }
+        /* Records carry every field, uncolored and with numeric ids */
+        long_flag = 1;
+        color_enabled = 0;
+        prewarm_ids = 0;
+    }
+    if (color_enabled) colors_init();
+
+    /* As in GNU ls: -c and -u sort by that time unless -l only shows it */
+    if (time_field != TIME_MTIME && !long_flag && sort_mode == SORT_NAME) sort_mode = SORT_TIME;
+    if (time_field == TIME_CTIME) sort_mask |= STATX_CTIME;
+    if (time_field == TIME_ATIME) sort_mask |= STATX_ATIME;
+    if (sort_mode == SORT_TIME && time_field == TIME_MTIME) sort_mask |= STATX_MTIME;
+    if (sort_mode == SORT_SIZE) sort_mask |= STATX_SIZE;
+
+    stats.start = stats_clock();
+    if (prewarm_ids && long_flag) idcache_prewarm();
+
+    /* Load the timezone rules once instead of on every localtime call */
+    tzset();
+
+    /* Only the character set matters: names still sort bytewise */
+    setlocale(LC_CTYPE, "");
+    multibyte_locale = (MB_CUR_MAX > 1);
+
+    out_init_fd(&out_stdout, STDOUT_FILENO);
+
+    if (watch_flag)
+    {
+        static const char *dot[] = { "." };
+        if (optind == argc) watch_run(dot, 1, long_flag, horizontal_flag, recursive_flag);
+        else watch_run(argv + optind, argc - optind, long_flag, horizontal_flag, recursive_flag);
+        out_flush(&out_stdout);
+        return 0;
     }
 
     if (optind == argc)
@@ -69,14 +822,20 @@ int main(int argc, char const *argv[])
         int multiple = (argc - optind > 1);
         for (int i = optind; i < argc; i++)
         {
-            if (multiple)
-                printf("Directory listing of %s:\n", argv[i]);
+            if (multiple && out_format == FMT_TEXT && !du_flag)
+            {
+                out_str(&out_stdout, "Directory listing of ");
+                out_str(&out_stdout, argv[i]);
+                out_str(&out_stdout, ":\n");
+            }
             do_ls(argv[i], long_flag, horizontal_flag, recursive_flag);
-            if (i < argc - 1)
-                puts("");
+            if (i < argc - 1 && out_format == FMT_TEXT && !du_flag)
+                out_putc(&out_stdout, '\n');
         }
     }
 
+    out_flush(&out_stdout);
+    stats_report();
     return 0;
 }
 
@@ -102,218 +861,3963 @@ void mode_to_str(mode_t mode, char *str)
     str[10] = '\0';
 }
 
+/* 0 until first asked, and again after --watch sees a resize */
+static int term_width_cached;
+
+/* Asked once per run: every directory of a -R walk shares the answer */
 int get_term_width(void)
 {
+    int width = __atomic_load_n(&term_width_cached, __ATOMIC_RELAXED);
+    if (width) return width;
+
     struct winsize ws;
-    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1) return 80;
-    return ws.ws_col > 0 ? ws.ws_col : 80;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) width = 80;
+    else width = ws.ws_col;
+    __atomic_store_n(&term_width_cached, width, __ATOMIC_RELAXED);
+    return width;
 }
 
-int is_tarball(const char *name)
+/* ---------- LS_COLORS Classifier ---------- */
+
+static size_t ext_hash(const char *ext, size_t len)
 {
-    if (!name) return 0;
-    const char *ext = strrchr(name, '.');
-    if (!ext) return 0;
-    return (
-        strcasecmp(ext, ".tar") == 0 ||
-        strcasecmp(ext, ".gz") == 0 ||
-        strcasecmp(ext, ".zip") == 0 ||
-        strcasecmp(ext, ".tgz") == 0 ||
-        strstr(name, ".tar.gz") != NULL
-    );
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (unsigned char)ext[i]) * 16777619u;
+    return h;
 }
 
-void print_colored_padded(FileEntry *e, int col_width)
+/* Slot holding the lowercased `ext`, or the empty slot where it belongs */
+static ExtSlot *ext_slot(const char *ext, size_t len)
 {
-    const char *color = NULL;
-    mode_t m = e->mode;
-
-    if (e->is_symlink) color = ANSI_MAGENTA;
-    else if (S_ISDIR(m)) color = ANSI_BLUE;
-    else if (S_ISCHR(m) || S_ISBLK(m) || S_ISSOCK(m) || S_ISFIFO(m)) color = ANSI_REVERSE;
-    else if (is_tarball(e->name)) color = ANSI_RED;
-    else if (m & (S_IXUSR | S_IXGRP | S_IXOTH)) color = ANSI_GREEN;
-
-    int len = (int)strlen(e->name);
-    if (color) printf("%s%s%s", color, e->name, ANSI_RESET);
-    else printf("%s", e->name);
+    size_t mask = ext_cap - 1;
+    size_t i = ext_hash(ext, len) & mask;
+    while (ext_table[i].len && (ext_table[i].len != len || memcmp(ext_table[i].ext, ext, len) != 0))
+        i = (i + 1) & mask;
+    return &ext_table[i];
+}
 
-    int pad = col_width - len;
-    for (int i = 0; i < pad; ++i) putchar(' ');
+/* Register "\033[<code>m" and return its index; "0"/"00" mean uncolored */
+static unsigned short color_add(const char *code)
+{
+    if (*code == '\0' || strcmp(code, "0") == 0 || strcmp(code, "00") == 0) return 0;
+    if (ncolor_seqs == COLORS_MAX) return 0;
+    char *seq;
+    if (asprintf(&seq, "\033[%sm", code) == -1)
+    {
+        perror("asprintf");
+        exit(EXIT_FAILURE);
+    }
+    color_seqs[ncolor_seqs] = seq;
+    return (unsigned short)ncolor_seqs++;
 }
 
-void display_horizontal(FileEntry entries[], int count)
+/* Parse LS_COLORS (or DEFAULT_COLORS when it is unset) into the type
+ * colors and the extension table. Only "*.ext" patterns are supported
+ * among the glob keys, "*.tar.gz" included; later entries override
+ * earlier ones as in GNU ls. */
+void colors_init(void)
 {
-    int maxlen = 0;
-    for (int i = 0; i < count; i++)
-        if ((int)strlen(entries[i].name) > maxlen)
-            maxlen = strlen(entries[i].name);
+    static const struct { const char *key; int tc; } type_keys[] = {
+        { "di", TC_DI }, { "ln", TC_LN }, { "pi", TC_PI }, { "so", TC_SO },
+        { "bd", TC_BD }, { "cd", TC_CD }, { "ex", TC_EX }, { "fi", TC_FI }
+    };
 
-    int term_width = get_term_width();
-    int col_width = maxlen + 2;
-    int curr_width = 0;
+    const char *env = getenv("LS_COLORS");
+    char *spec = strdup(env ? env : DEFAULT_COLORS);
+    if (!spec)
+    {
+        perror("strdup");
+        exit(EXIT_FAILURE);
+    }
 
-    for (int i = 0; i < count; i++)
+    size_t nitems = 1;
+    for (const char *p = spec; *p; p++)
+        if (*p == ':') nitems++;
+    if (nitems > COLORS_MAX - 1) nitems = COLORS_MAX - 1;
+    for (ext_cap = 16; ext_cap < nitems * 2; ext_cap *= 2)
+        ;
+    ext_table = calloc(ext_cap, sizeof(ExtSlot));
+    color_seqs = calloc(nitems + 1, sizeof(char *));
+    if (!ext_table || !color_seqs)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    ncolor_seqs = 1;
+
+    char *save = NULL;
+    for (char *item = strtok_r(spec, ":", &save); item; item = strtok_r(NULL, ":", &save))
     {
-        if (curr_width + col_width > term_width)
+        char *eq = strchr(item, '=');
+        if (!eq || ncolor_seqs > nitems) continue;
+        *eq = '\0';
+        const char *key = item, *code = eq + 1;
+
+        if (key[0] == '*' && key[1] == '.')
+        {
+            size_t len = strlen(key + 2);
+            if (len == 0 || len > EXT_MAX) continue;
+            char ext[EXT_MAX + 1];
+            for (size_t i = 0; i < len; i++)
+                ext[i] = (char)tolower((unsigned char)key[2 + i]);
+            if (memchr(ext, '.', len)) ext_multi_dot = 1;
+            ExtSlot *slot = ext_slot(ext, len);
+            memcpy(slot->ext, ext, len);
+            slot->len = (unsigned char)len;
+            slot->color = color_add(code);
+        }
+        else if (strcmp(key, "rs") == 0)
         {
-            printf("\n");
-            curr_width = 0;
+            unsigned short c = color_add(code);
+            if (c) color_reset = color_seqs[c];
+        }
+        else if (strcmp(key, "ln") == 0 && strcmp(code, "target") == 0)
+        {
+            link_as_target = 1;
+            type_color[TC_LN] = 0;
+        }
+        else
+        {
+            if (strcmp(key, "ln") == 0) link_as_target = 0;
+            for (size_t k = 0; k < sizeof(type_keys) / sizeof(type_keys[0]); k++)
+                if (strcmp(key, type_keys[k].key) == 0)
+                    type_color[type_keys[k].tc] = color_add(code);
         }
-        print_colored_padded(&entries[i], col_width);
-        curr_width += col_width;
     }
-    printf("\n");
+    free(spec);
 }
 
-void display_vertical(FileEntry entries[], int count)
+/* Color of the name's extension, matched without regard to case; 0 when
+ * it has none. The suffix after the last dot is the only candidate
+ * unless multi-dot keys were given: then every dot in the last EXT_MAX + 1
+ * bytes starts one, and the longest suffix that has a color wins. */
+unsigned short color_for_ext(const char *name, size_t len)
 {
-    int maxlen = 0;
-    for (int i = 0; i < count; i++)
-        if ((int)strlen(entries[i].name) > maxlen)
-            maxlen = strlen(entries[i].name);
-
-    int term_width = get_term_width();
-    int col_width = maxlen + 2;
-    int cols = term_width / col_width;
-    if (cols < 1) cols = 1;
-    int rows = (count + cols - 1) / cols;
-
-    for (int r = 0; r < rows; r++)
+    if (!ext_table) return 0;
+    size_t from = ext_multi_dot && len > EXT_MAX + 1 ? len - EXT_MAX - 1 : 0;
+    const char *dot = ext_multi_dot ? memchr(name + from, '.', len - from) : memrchr(name, '.', len);
+    for (; dot; dot = memchr(dot + 1, '.', len - (size_t)(dot + 1 - name)))
     {
-        for (int c = 0; c < cols; c++)
+        size_t elen = len - (size_t)(dot + 1 - name);
+        if (elen == 0) return 0;
+        if (elen <= EXT_MAX)
         {
-            int idx = c * rows + r;
-            if (idx < count)
-                print_colored_padded(&entries[idx], col_width);
+            char ext[EXT_MAX];
+            for (size_t i = 0; i < elen; i++)
+                ext[i] = (char)tolower((unsigned char)dot[1 + i]);
+            ExtSlot *slot = ext_slot(ext, elen);
+            if (slot->len) return slot->color;
         }
-        printf("\n");
+        if (!ext_multi_dot) break;
     }
+    return 0;
 }
 
-int cmp_entry(const void *a, const void *b)
+/* Final color once the mode is known: the file type decides for
+ * everything but regular files, which keep an extension color and fall
+ * back to ex or fi. With ln=target a symlink is colored as its target,
+ * type and name, as GNU ls does; a dangling one stays uncolored. */
+void color_classify(FileEntry *e, int dirfd)
 {
-    const FileEntry *ea = a;
-    const FileEntry *eb = b;
-    return strcmp(ea->name, eb->name);
+    mode_t m = e->mode;
+    if (S_ISLNK(m) && link_as_target)
+    {
+        struct stat st;
+        stats_count(SC_FSTATAT, 1);
+        if (fstatat(dirfd, e->name, &st, 0) == -1)
+        {
+            e->color = 0;
+            return;
+        }
+        m = st.st_mode;
+        if (S_ISREG(m))
+        {
+            char target[PATH_MAX];
+            ssize_t n = readlinkat(dirfd, e->name, target, sizeof(target));
+            e->color = n > 0 ? color_for_ext(target, (size_t)n) : 0;
+        }
+    }
+    int tc;
+    if (S_ISLNK(m)) tc = TC_LN;
+    else if (S_ISDIR(m)) tc = TC_DI;
+    else if (S_ISFIFO(m)) tc = TC_PI;
+    else if (S_ISSOCK(m)) tc = TC_SO;
+    else if (S_ISBLK(m)) tc = TC_BD;
+    else if (S_ISCHR(m)) tc = TC_CD;
+    else if (e->color) return;
+    else tc = (m & (S_IXUSR | S_IXGRP | S_IXOTH)) ? TC_EX : TC_FI;
+    e->color = type_color[tc];
 }
 
-/* ---------- Recursive ls ---------- */
-void do_ls(const char *dir, int long_flag, int horizontal_flag, int recursive_flag)
+/* Length of the leading run of ASCII bytes: 16 bytes per step with SSE2,
+ * then 8 per step in a plain word */
+static size_t ascii_prefix(const char *s, size_t len)
 {
-    DIR *dp = opendir(dir);
-    if (!dp)
+    size_t i = 0;
+#ifdef __SSE2__
+    for (; i + 16 <= len; i += 16)
     {
-        fprintf(stderr, "Cannot open directory: %s\n", dir);
-        return;
+        int high = _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(s + i)));
+        if (high) return i + (size_t)__builtin_ctz((unsigned)high);
     }
-
-    printf("%s:\n", dir);  // header for recursive display
-
-    errno = 0;
-    size_t cap = 128, count = 0;
-    FileEntry *entries = malloc(cap * sizeof(FileEntry));
-    if (!entries)
+#endif
+    for (; i + 8 <= len; i += 8)
     {
-        perror("malloc");
-        closedir(dp);
-        return;
+        uint64_t w;
+        memcpy(&w, s + i, sizeof(w));
+        if (w & 0x8080808080808080ull) break;
     }
+    while (i < len && !((unsigned char)s[i] & 0x80)) i++;
+    return i;
+}
 
-    struct dirent *entry;
-    while ((entry = readdir(dp)) != NULL)
-    {
-        if (entry->d_name[0] == '.') continue;
+/* Terminal columns taken by a name. ASCII names are their byte length;
+ * the rest is decoded in the current locale and measured with wcwidth.
+ * Bytes that do not decode, and unprintable characters, count as one
+ * column each, the width of the replacement glyph a terminal shows. */
+int name_width(const char *s, size_t len)
+{
+    size_t i = ascii_prefix(s, len);
+    if (i == len || !multibyte_locale) return (int)len;
 
-        if (count + 1 >= cap)
+    int width = (int)i;
+    mbstate_t st;
+    memset(&st, 0, sizeof(st));
+    while (i < len)
+    {
+        if (!((unsigned char)s[i] & 0x80))
         {
-            cap *= 2;
-            entries = realloc(entries, cap * sizeof(FileEntry));
+            width++;
+            i++;
+            continue;
         }
-
-        char path[PATH_MAX];
-        snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
-
-        struct stat st;
-        if (lstat(path, &st) == -1) continue;
-
-        entries[count].name = strdup(entry->d_name);
-        entries[count].mode = st.st_mode;
-        entries[count].size = st.st_size;
-        entries[count].is_symlink = S_ISLNK(st.st_mode);
-        count++;
+        wchar_t wc;
+        size_t n = mbrtowc(&wc, s + i, len - i, &st);
+        if (n == (size_t)-1 || n == (size_t)-2)
+        {
+            memset(&st, 0, sizeof(st));
+            width++;
+            i++;
+            continue;
+        }
+        int w = wcwidth(wc);
+        width += w >= 0 ? w : 1;
+        i += n;
     }
-    closedir(dp);
-    if (errno != 0) perror("readdir failed");
+    return width;
+}
 
-    if (count == 0)
-    {
-        printf("\n");
-        free(entries);
-        return;
-    }
+void print_colored_padded(OutBuf *out, FileEntry *e, int col_width)
+{
+    const char *color = e->color ? color_seqs[e->color] : NULL;
 
-    qsort(entries, count, sizeof(FileEntry), cmp_entry);
+    if (color) out_str(out, color);
+    out_write(out, e->name, e->name_len);
+    if (color) out_str(out, color_reset);
 
-    if (long_flag)
-    {
-        for (size_t i = 0; i < count; i++)
-        {
-            char path[PATH_MAX];
-            snprintf(path, sizeof(path), "%s/%s", dir, entries[i].name);
+    out_pad(out, col_width - e->name_width);
+}
 
-            struct stat st;
-            if (lstat(path, &st) == -1) continue;
+/* Assembled field by field instead of through printf: same layout as
+ * "%s %2ld %s %s %6lld %s " */
+void print_long_entry(OutBuf *out, FileEntry *e)
+{
+    char perms[11];
+    mode_to_str(e->mode, perms);
 
-            char perms[11];
-            mode_to_str(st.st_mode, perms);
+    char timebuf[TIME_LEN];
+    format_time(time_field == TIME_CTIME ? e->ctime : time_field == TIME_ATIME ? e->atime : e->mtime,
+                timebuf);
 
-            struct passwd *pw = getpwuid(st.st_uid);
-            struct group *gr = getgrgid(st.st_gid);
+    out_write(out, perms, 10);
+    out_putc(out, ' ');
+    out_num(out, (long long)e->nlink, 2);
+    out_putc(out, ' ');
+    out_str(out, uid_name(e->uid));
+    out_putc(out, ' ');
+    out_str(out, gid_name(e->gid));
+    out_putc(out, ' ');
+    out_num(out, (long long)e->size, 6);
+    out_putc(out, ' ');
+    out_write(out, timebuf, TIME_LEN);
+    out_putc(out, ' ');
+    print_colored_padded(out, e, 0);
+    out_putc(out, '\n');
+}
 
-            char timebuf[64];
-            struct tm *tm = localtime(&st.st_mtime);
-            strftime(timebuf, sizeof(timebuf), "%b %e %H:%M", tm);
+/* Pick the most columns that fit the terminal when every column is only
+ * as wide as its own longest name, as GNU ls does. All candidate counts
+ * are tried in one pass over the names: each keeps its running column
+ * widths and drops out as soon as its line gets too long. `by_rows` lays
+ * entries out across (-x) instead of down. Widths are display columns,
+ * so multibyte names line up. Returns the column count and
+ * points *widths at the chosen column widths, gap included. */
+static int layout_columns(const FileEntry *entries, int count, int by_rows, const size_t **widths)
+{
+    size_t term_width = (size_t)get_term_width();
+    int max_cols = (int)(term_width / COL_MIN_WIDTH);
+    if (max_cols < 1) max_cols = 1;
+    if (max_cols > count) max_cols = count;
 
-            printf("%s %2ld %s %s %6lld %s ",
-                   perms, (long)st.st_nlink,
-                   pw ? pw->pw_name : "?",
-                   gr ? gr->gr_name : "?",
-                   (long long)st.st_size,
-                   timebuf);
-            print_colored_padded(&entries[i], 0);
-            printf("\n");
-        }
+    ColumnInfo *ci = arena_alloc(&entry_arena, (size_t)max_cols * sizeof(ColumnInfo));
+    size_t *cells = arena_alloc(&entry_arena,
+                                (size_t)max_cols * (max_cols + 1) / 2 * sizeof(size_t));
+    for (int i = 0; i < max_cols; i++)
+    {
+        ci[i].valid = 1;
+        ci[i].line_len = (size_t)(i + 1) * COL_MIN_WIDTH;
+        ci[i].col_arr = cells + (size_t)i * (i + 1) / 2;
+        for (int j = 0; j <= i; j++)
+            ci[i].col_arr[j] = COL_MIN_WIDTH;
     }
-    else if (horizontal_flag)
+
+    for (int f = 0; f < count; f++)
     {
-        display_horizontal(entries, (int)count);
+        for (int i = 0; i < max_cols; i++)
+        {
+            if (!ci[i].valid) continue;
+            int col = by_rows ? f % (i + 1) : f / ((count + i) / (i + 1));
+            size_t w = (size_t)entries[f].name_width + (col == i ? 0 : COL_GAP);
+            if (ci[i].col_arr[col] < w)
+            {
+                ci[i].line_len += w - ci[i].col_arr[col];
+                ci[i].col_arr[col] = w;
+                ci[i].valid = ci[i].line_len < term_width;
+            }
+        }
     }
-    else
+
+    int cols = max_cols;
+    while (cols > 1 && !ci[cols - 1].valid) cols--;
+    *widths = ci[cols - 1].col_arr;
+    return cols;
+}
+
+void display_horizontal(OutBuf *out, FileEntry entries[], int count)
+{
+    const size_t *widths;
+    int cols = layout_columns(entries, count, 1, &widths);
+
+    for (int i = 0; i < count; i++)
     {
-        display_vertical(entries, (int)count);
+        int col = i % cols;
+        int last = (col == cols - 1 || i == count - 1);
+        print_colored_padded(out, &entries[i], last ? 0 : (int)widths[col]);
+        if (last) out_putc(out, '\n');
     }
+}
+
+void display_vertical(OutBuf *out, FileEntry entries[], int count)
+{
+    const size_t *widths;
+    int cols = layout_columns(entries, count, 0, &widths);
+    int rows = (count + cols - 1) / cols;
 
-    /* ---------- Recursion ---------- */
-    if (recursive_flag)
+    for (int r = 0; r < rows; r++)
     {
-        for (size_t i = 0; i < count; i++)
+        for (int c = 0; c < cols; c++)
         {
-            if (S_ISDIR(entries[i].mode))
-            {
-                if (strcmp(entries[i].name, ".") == 0 || strcmp(entries[i].name, "..") == 0)
-                    continue;
-
-                char subpath[PATH_MAX];
-                snprintf(subpath, sizeof(subpath), "%s/%s", dir, entries[i].name);
-                printf("\n");
-                do_ls(subpath, long_flag, horizontal_flag, recursive_flag);
-            }
+            int idx = c * rows + r;
+            if (idx >= count) break;
+            int last = (idx + rows >= count);
+            print_colored_padded(out, &entries[idx], last ? 0 : (int)widths[c]);
         }
+        out_putc(out, '\n');
     }
+}
 
-    for (size_t i = 0; i < count; i++)
-        free(entries[i].name);
-    free(entries);
+int cmp_entry(const void *a, const void *b)
+{
+    const FileEntry *ea = a;
+    const FileEntry *eb = b;
+    return strcmp(ea->name, eb->name);
+}
+
+/* ---------- uid/gid Name Cache ---------- */
+
+/* Slot holding `id`, or the empty slot where it belongs */
+IdSlot *idcache_slot(IdCache *c, unsigned int id)
+{
+    size_t mask = c->cap - 1;
+    size_t i = (id * 2654435761u) & mask;
+    while (c->slots[i].used && c->slots[i].id != id)
+        i = (i + 1) & mask;
+    return &c->slots[i];
 }
 
+/* Record `name` for `id`; a NULL name caches a negative lookup */
+void idcache_put(IdCache *c, unsigned int id, const char *name)
+{
+    if ((c->count + 1) * 4 > c->cap * 3)
+    {
+        size_t old_cap = c->cap;
+        IdSlot *old = c->slots;
+        c->cap = old_cap ? old_cap * 2 : 64;
+        c->slots = calloc(c->cap, sizeof(IdSlot));
+        if (!c->slots)
+        {
+            perror("calloc");
+            exit(EXIT_FAILURE);
+        }
+        for (size_t i = 0; i < old_cap; i++)
+            if (old[i].used) *idcache_slot(c, old[i].id) = old[i];
+        free(old);
+    }
+
+    IdSlot *slot = idcache_slot(c, id);
+    if (slot->used) return;
+    slot->used = 1;
+    slot->id = id;
+    slot->name = name ? strdup(name) : NULL;
+    c->count++;
+}
+
+/* Cached names are never freed or moved, so the returned pointer stays
+ * valid after the lock is dropped. The lookup buffer starts at the
+ * size sysconf suggests and doubles on ERANGE: LDAP and sssd groups
+ * with many members do not fit a fixed one. Only a lookup that worked
+ * and found nothing is cached as unknown; errors are retried next time. */
+const char *uid_name(uid_t uid)
+{
+    pthread_mutex_lock(&idcache_lock);
+    IdSlot *slot = uid_cache.cap ? idcache_slot(&uid_cache, uid) : NULL;
+    if (!slot || !slot->used)
+    {
+        long hint = sysconf(_SC_GETPW_R_SIZE_MAX);
+        size_t size = hint > 0 ? (size_t)hint : 1024;
+        char *buf = NULL;
+        struct passwd pwd, *pw = NULL;
+        int rc;
+        for (;;)
+        {
+            char *grown = realloc(buf, size);
+            if (!grown)
+            {
+                rc = ENOMEM;
+                break;
+            }
+            buf = grown;
+            rc = getpwuid_r(uid, &pwd, buf, size, &pw);
+            stats_count(SC_NSS, 1);
+            if (rc != ERANGE) break;
+            size *= 2;
+        }
+        if (rc == 0) idcache_put(&uid_cache, uid, pw ? pw->pw_name : NULL);
+        free(buf);
+        slot = rc == 0 ? idcache_slot(&uid_cache, uid) : NULL;
+    }
+    const char *name = slot ? slot->name : NULL;
+    pthread_mutex_unlock(&idcache_lock);
+    return name ? name : "?";
+}
+
+const char *gid_name(gid_t gid)
+{
+    pthread_mutex_lock(&idcache_lock);
+    IdSlot *slot = gid_cache.cap ? idcache_slot(&gid_cache, gid) : NULL;
+    if (!slot || !slot->used)
+    {
+        long hint = sysconf(_SC_GETGR_R_SIZE_MAX);
+        size_t size = hint > 0 ? (size_t)hint : 4096;
+        char *buf = NULL;
+        struct group grp, *gr = NULL;
+        int rc;
+        for (;;)
+        {
+            char *grown = realloc(buf, size);
+            if (!grown)
+            {
+                rc = ENOMEM;
+                break;
+            }
+            buf = grown;
+            rc = getgrgid_r(gid, &grp, buf, size, &gr);
+            stats_count(SC_NSS, 1);
+            if (rc != ERANGE) break;
+            size *= 2;
+        }
+        if (rc == 0) idcache_put(&gid_cache, gid, gr ? gr->gr_name : NULL);
+        free(buf);
+        slot = rc == 0 ? idcache_slot(&gid_cache, gid) : NULL;
+    }
+    const char *name = slot ? slot->name : NULL;
+    pthread_mutex_unlock(&idcache_lock);
+    return name ? name : "?";
+}
+
+/* Load every user and group in one enumeration instead of one NSS
+ * round-trip per distinct id */
+void idcache_prewarm(void)
+{
+    struct passwd *pw;
+    setpwent();
+    while ((pw = getpwent()) != NULL)
+        idcache_put(&uid_cache, pw->pw_uid, pw->pw_name);
+    endpwent();
+
+    struct group *gr;
+    setgrent();
+    while ((gr = getgrent()) != NULL)
+        idcache_put(&gid_cache, gr->gr_gid, gr->gr_name);
+    endgrent();
+}
+
+/* Parse a byte count with an optional K/M suffix; 0 on error */
+size_t parse_size(const char *arg)
+{
+    char *end;
+    errno = 0;
+    unsigned long long v = strtoull(arg, &end, 10);
+    if (errno != 0 || end == arg) return 0;
+    if (*end == 'K' || *end == 'k') { v *= 1024; end++; }
+    else if (*end == 'M' || *end == 'm') { v *= 1024 * 1024; end++; }
+    if (*end != '\0') return 0;
+    return (size_t)v;
+}
+
+/* ---------- Name Sort Engine ---------- */
+
+/* Bytes [depth, depth+8) of `s`, zero-padded past the terminator. The
+ * caller guarantees the first `depth` bytes hold no NUL. */
+static inline uint64_t name_key(const char *s, size_t depth)
+{
+    const unsigned char *p = (const unsigned char *)s + depth;
+    uint64_t k = 0;
+    int i = 0;
+    for (; i < 8 && p[i]; i++) k = (k << 8) | p[i];
+    return k << (8 * (8 - i));
+}
+
+static void sort_insertion(SortKey *a, size_t n, size_t depth, const FileEntry *entries)
+{
+    for (size_t i = 1; i < n; i++)
+    {
+        SortKey v = a[i];
+        const char *vs = entries[v.idx].name + depth;
+        size_t j = i;
+        while (j > 0 && (a[j - 1].key > v.key ||
+               (a[j - 1].key == v.key && strcmp(entries[a[j - 1].idx].name + depth, vs) > 0)))
+        {
+            a[j] = a[j - 1];
+            j--;
+        }
+        a[j] = v;
+    }
+}
+
+/* LSD byte radix over the 64-bit keys; passes where every key shares the
+ * byte are skipped, which is common for names with a shared prefix */
+static void sort_radix_keys(SortKey *a, SortKey *tmp, size_t n)
+{
+    size_t counts[8][256];
+    memset(counts, 0, sizeof(counts));
+    for (size_t i = 0; i < n; i++)
+        for (int b = 0; b < 8; b++)
+            counts[b][(a[i].key >> (8 * b)) & 0xff]++;
+
+    SortKey *src = a, *dst = tmp;
+    for (int b = 0; b < 8; b++)
+    {
+        size_t *c = counts[b];
+        if (c[(src[0].key >> (8 * b)) & 0xff] == n) continue;
+
+        size_t sum = 0;
+        for (int v = 0; v < 256; v++)
+        {
+            size_t t = c[v];
+            c[v] = sum;
+            sum += t;
+        }
+        for (size_t i = 0; i < n; i++)
+            dst[c[(src[i].key >> (8 * b)) & 0xff]++] = src[i];
+
+        SortKey *sw = src;
+        src = dst;
+        dst = sw;
+    }
+    if (src != a) memcpy(a, src, n * sizeof(SortKey));
+}
+
+/* MSD over 8-byte digits: radix-sort the current digit, then recurse
+ * into every run whose names agree on it and continue past it */
+static void sort_msd(SortKey *a, SortKey *tmp, size_t n, size_t depth, const FileEntry *entries)
+{
+    if (n <= SORT_INSERTION)
+    {
+        sort_insertion(a, n, depth, entries);
+        return;
+    }
+
+    sort_radix_keys(a, tmp, n);
+
+    size_t start = 0;
+    while (start < n)
+    {
+        size_t end = start + 1;
+        while (end < n && a[end].key == a[start].key) end++;
+        /* A NUL inside the digit means the names ended and are equal */
+        if (end - start > 1 && (a[start].key & 0xff) != 0)
+        {
+            for (size_t i = start; i < end; i++)
+                a[i].key = name_key(entries[a[i].idx].name, depth + 8);
+            sort_msd(a + start, tmp + start, end - start, depth + 8, entries);
+        }
+        start = end;
+    }
+}
+
+typedef struct {
+    SortKey *keys;
+    SortKey *tmp;
+    const FileEntry *entries;
+    size_t bounds[257];         /* bucket b is keys[bounds[b], bounds[b+1]) */
+    int next;                   /* next bucket to claim */
+} SortJob;
+
+static void *sort_worker(void *arg)
+{
+    SortJob *job = arg;
+    int b;
+    while ((b = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < 256)
+    {
+        size_t lo = job->bounds[b], n = job->bounds[b + 1] - lo;
+        if (n > 1)
+            sort_msd(job->keys + lo, job->tmp + lo, n, 0, job->entries);
+    }
+    return NULL;
+}
+
+/* Split on the first byte, then sort the 256 buckets on several threads.
+ * Keys keep their full first digit, so each bucket is a plain sort_msd. */
+static void sort_parallel(SortKey *keys, SortKey *tmp, size_t n, const FileEntry *entries,
+                          int nthreads)
+{
+    SortJob job;
+    size_t counts[256] = { 0 };
+    for (size_t i = 0; i < n; i++)
+        counts[keys[i].key >> 56]++;
+
+    size_t sum = 0;
+    for (int b = 0; b < 256; b++)
+    {
+        job.bounds[b] = sum;
+        sum += counts[b];
+    }
+    job.bounds[256] = n;
+
+    size_t pos[256];
+    memcpy(pos, job.bounds, sizeof(pos));
+    for (size_t i = 0; i < n; i++)
+        tmp[pos[keys[i].key >> 56]++] = keys[i];
+
+    job.keys = tmp;
+    job.tmp = keys;
+    job.entries = entries;
+    job.next = 0;
+
+    pthread_t threads[SORT_THREADS_MAX];
+    int started = 0;
+    for (; started < nthreads - 1; started++)
+        if (pthread_create(&threads[started], NULL, sort_worker, &job) != 0) break;
+    sort_worker(&job);
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    memcpy(keys, tmp, n * sizeof(SortKey));
+}
+
+/* Byte-order (strcmp) sort of a directory listing. Works on compact
+ * (prefix, index) pairs and moves each FileEntry exactly once at the end. */
+void sort_entries_by_name(FileEntry *entries, size_t count)
+{
+    if (count < SORT_SMALL || count > UINT32_MAX)
+    {
+        qsort(entries, count, sizeof(FileEntry), cmp_entry);
+        return;
+    }
+
+    SortKey *keys = malloc(count * sizeof(SortKey));
+    SortKey *tmp = malloc(count * sizeof(SortKey));
+    FileEntry *sorted = malloc(count * sizeof(FileEntry));
+    if (!keys || !tmp || !sorted)
+    {
+        free(keys);
+        free(tmp);
+        free(sorted);
+        qsort(entries, count, sizeof(FileEntry), cmp_entry);
+        return;
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        keys[i].key = name_key(entries[i].name, 0);
+        keys[i].idx = (uint32_t)i;
+    }
+
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpu > SORT_THREADS_MAX) ncpu = SORT_THREADS_MAX;
+    if (count >= SORT_PARALLEL_MIN && ncpu > 1)
+        sort_parallel(keys, tmp, count, entries, (int)ncpu);
+    else
+        sort_msd(keys, tmp, count, 0, entries);
+
+    for (size_t i = 0; i < count; i++)
+        sorted[i] = entries[keys[i].idx];
+    memcpy(entries, sorted, count * sizeof(FileEntry));
+
+    free(keys);
+    free(tmp);
+    free(sorted);
+}
+
+/* The -S/-t/-X key of an entry, packed so that ascending integer order
+ * is the listing order: largest and newest come first, and -X compares
+ * the first eight bytes of the extension, dot included. Times are exact
+ * for years 1698 to 2242. */
+static inline uint64_t order_key(const FileEntry *e)
+{
+    switch (sort_mode)
+    {
+    case SORT_SIZE:
+        return ~(uint64_t)e->size;
+    case SORT_TIME:
+    {
+        /* 34 bits of seconds around the epoch, then 30 of nanoseconds */
+        time_t t = time_field == TIME_CTIME ? e->ctime : time_field == TIME_ATIME ? e->atime : e->mtime;
+        uint32_t ns = time_field == TIME_CTIME ? e->ctime_nsec :
+                      time_field == TIME_ATIME ? e->atime_nsec : e->mtime_nsec;
+        return ~((((uint64_t)t + (1ull << 33)) << 30) | ns);
+    }
+    case SORT_EXT:
+    {
+        const char *ext = strrchr(e->name, '.');
+        return ext ? name_key(ext, 0) : 0;
+    }
+    default:
+        return 0;
+    }
+}
+
+static int cmp_order(const void *a, const void *b)
+{
+    uint64_t ka = order_key(a), kb = order_key(b);
+    if (ka != kb) return ka < kb ? -1 : 1;
+    if (sort_mode == SORT_EXT)
+    {
+        const char *xa = strrchr(((const FileEntry *)a)->name, '.');
+        const char *xb = strrchr(((const FileEntry *)b)->name, '.');
+        int c = strcmp(xa ? xa : "", xb ? xb : "");
+        if (c) return c;
+    }
+    return cmp_entry(a, b);
+}
+
+/* Extensions that share their first depth + 8 bytes tie on the key;
+ * radix-sort each such run on the next eight bytes, and again while
+ * they still tie. The pass is stable, so name order is kept within. */
+static void order_ext_runs(SortKey *keys, SortKey *tmp, size_t n, const FileEntry *entries, size_t depth)
+{
+    size_t start = 0;
+    while (start < n)
+    {
+        size_t end = start + 1;
+        while (end < n && keys[end].key == keys[start].key) end++;
+        if (end - start > 1 && (keys[start].key & 0xff) != 0)
+        {
+            SortKey *run = keys + start;
+            size_t len = end - start;
+            for (size_t i = 0; i < len; i++)
+                run[i].key = name_key(strrchr(entries[run[i].idx].name, '.'), depth + 8);
+            sort_radix_keys(run, tmp, len);
+            order_ext_runs(run, tmp, len, entries, depth + 8);
+        }
+        start = end;
+    }
+}
+
+/* Put name-sorted entries in the -S/-t/-X order and apply -r. Each key
+ * is computed once; the LSD radix pass is stable, so the name order the
+ * entries arrive in breaks the ties. */
+void order_entries(FileEntry *entries, size_t count)
+{
+    if (count < 2) return;
+
+    if (sort_mode != SORT_NAME)
+    {
+        SortKey *keys = count <= UINT32_MAX ? malloc(count * sizeof(SortKey)) : NULL;
+        SortKey *tmp = keys ? malloc(count * sizeof(SortKey)) : NULL;
+        FileEntry *sorted = tmp ? malloc(count * sizeof(FileEntry)) : NULL;
+        if (!sorted)
+        {
+            free(keys);
+            free(tmp);
+            qsort(entries, count, sizeof(FileEntry), cmp_order);
+        }
+        else
+        {
+            for (size_t i = 0; i < count; i++)
+            {
+                keys[i].key = order_key(&entries[i]);
+                keys[i].idx = (uint32_t)i;
+            }
+            sort_radix_keys(keys, tmp, count);
+            if (sort_mode == SORT_EXT) order_ext_runs(keys, tmp, count, entries, 0);
+
+            for (size_t i = 0; i < count; i++)
+                sorted[i] = entries[keys[i].idx];
+            memcpy(entries, sorted, count * sizeof(FileEntry));
+            free(keys);
+            free(tmp);
+            free(sorted);
+        }
+    }
+
+    if (reverse_flag)
+    {
+        for (size_t i = 0, j = count - 1; i < j; i++, j--)
+        {
+            FileEntry t = entries[i];
+            entries[i] = entries[j];
+            entries[j] = t;
+        }
+    }
+}
+
+/* ---------- Directory Reader ---------- */
+
+/* One buffer per thread is shared by its readers: a directory is always
+ * read to the end before the listing recurses into its children. */
+static __thread char *dirbuf;
+static __thread size_t dirbuf_alloc;
+
+/* Open `name` relative to the directory descriptor `dirfd` (or AT_FDCWD) */
+int dir_open(DirReader *dr, int dirfd, const char *name)
+{
+    uint64_t t0 = stats_clock();
+    dr->fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    stats_latency(stats.hist_open, t0, 1);
+    stats_count(SC_OPENAT, 1);
+    if (dr->fd == -1) return -1;
+
+    if (dirbuf_alloc != dirbuf_size)
+    {
+        free(dirbuf);
+        dirbuf = malloc(dirbuf_size);
+        dirbuf_alloc = dirbuf ? dirbuf_size : 0;
+        if (!dirbuf)
+        {
+            close(dr->fd);
+            dr->fd = -1;
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+    dr->buf = dirbuf;
+    dr->bufsize = dirbuf_alloc;
+    dr->len = dr->pos = 0;
+    return 0;
+}
+
+/* Pull the next batch of entries; returns bytes read, 0 at end, -1 on error */
+ssize_t dir_fill(DirReader *dr)
+{
+    int prev = stats_enter(PH_READ);
+    long n = syscall(SYS_getdents64, dr->fd, dr->buf, dr->bufsize);
+    stats_count(SC_GETDENTS, 1);
+    stats_leave(prev);
+    if (n < 0) return -1;
+    dr->len = (size_t)n;
+    dr->pos = 0;
+    return n;
+}
+
+/* Next entry of the current batch, NULL once the batch is consumed */
+struct linux_dirent64 *dir_next(DirReader *dr)
+{
+    if (dr->pos >= dr->len) return NULL;
+    struct linux_dirent64 *d = (struct linux_dirent64 *)(dr->buf + dr->pos);
+    dr->pos += d->d_reclen;
+    return d;
+}
+
+void dir_close(DirReader *dr)
+{
+    if (dr->fd != -1)
+    {
+        close(dr->fd);
+        stats_count(SC_CLOSE, 1);
+    }
+    dr->fd = -1;
+}
+
+/* ---------- Metadata Backend ---------- */
+
+/* Smallest statx mask that still answers everything the listing prints */
+unsigned int meta_mask_for(int long_flag)
+{
+    /* The listing cache revalidates entries by their ctime; records print it */
+    return (long_flag ? META_MASK_LONG : META_MASK_SHORT) | sort_mask |
+           (cache_dir || out_format != FMT_TEXT ? STATX_CTIME : 0) | (du_flag ? STATX_INO : 0);
+}
+
+void statx_to_stat(const struct statx *stx, struct stat *st)
+{
+    memset(st, 0, sizeof(*st));
+    st->st_mode = stx->stx_mode;
+    st->st_nlink = stx->stx_nlink;
+    st->st_uid = stx->stx_uid;
+    st->st_gid = stx->stx_gid;
+    st->st_size = stx->stx_size;
+    st->st_blocks = stx->stx_blocks;
+    st->st_ino = stx->stx_ino;
+    st->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+    st->st_rdev = makedev(stx->stx_rdev_major, stx->stx_rdev_minor);
+    st->st_atim.tv_sec = stx->stx_atime.tv_sec;
+    st->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+    st->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+    st->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+    st->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+    st->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+}
+
+/* statx() `name` relative to `dirfd`, asking only for `mask`, and copy the
+ * result into a struct stat. Fields outside `mask` are left zeroed. Falls
+ * back to fstatat() on kernels without statx. */
+int meta_stat(int dirfd, const char *name, unsigned int mask, struct stat *st)
+{
+    uint64_t t0 = stats_clock();
+    int rc;
+    if (have_statx)
+    {
+        struct statx stx;
+        rc = statx(dirfd, name, meta_flags, mask, &stx);
+        stats_count(SC_STATX, 1);
+        if (rc == 0)
+        {
+            statx_to_stat(&stx, st);
+            stats_latency(stats.hist_stat, t0, 1);
+            return 0;
+        }
+        if (errno != ENOSYS) return -1;
+        have_statx = 0;
+    }
+    rc = fstatat(dirfd, name, st, meta_flags & AT_SYMLINK_NOFOLLOW);
+    stats_count(SC_FSTATAT, 1);
+    if (rc == 0) stats_latency(stats.hist_stat, t0, 1);
+    return rc;
+}
+
+/* ---------- io_uring Stat Engine ---------- */
+#ifdef HAVE_URING
+/* This thread's ring, set up on first use; NULL if io_uring is unavailable */
+StatRing *ring_get(void)
+{
+    if (stat_ring) return stat_ring;
+
+    StatRing *r = calloc(1, sizeof(StatRing));
+    if (!r) return NULL;
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    r->fd = (int)syscall(__NR_io_uring_setup, RING_ENTRIES, &p);
+    if (r->fd < 0)
+    {
+        free(r);
+        use_uring = 0;
+        return NULL;
+    }
+
+    r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (r->cq_len > r->sq_len) r->sq_len = r->cq_len;
+        r->cq_len = 0;
+    }
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     r->fd, IORING_OFF_SQ_RING);
+    r->cq_ptr = r->cq_len == 0 ? r->sq_ptr :
+                mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     r->fd, IORING_OFF_CQ_RING);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   r->fd, IORING_OFF_SQES);
+    if (r->sq_ptr == MAP_FAILED || r->cq_ptr == MAP_FAILED || r->sqes == MAP_FAILED)
+    {
+        stat_ring = r;
+        ring_free();
+        use_uring = 0;
+        return NULL;
+    }
+
+    char *sq = r->sq_ptr, *cq = r->cq_ptr;
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    stat_ring = r;
+    return r;
+}
+
+/* Reap the completions still owed; until then the kernel may write
+ * into r->results */
+static void ring_drain(StatRing *r)
+{
+    while (r->inflight > 0)
+    {
+        long ret = syscall(__NR_io_uring_enter, r->fd, 0, r->inflight, IORING_ENTER_GETEVENTS, NULL, 0);
+        stats_count(SC_URING_ENTER, 1);
+        if (ret < 0 && errno != EINTR) return;
+
+        unsigned head = *r->cq_head;
+        unsigned ctail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+        r->inflight -= ctail - head;
+        __atomic_store_n(r->cq_head, ctail, __ATOMIC_RELEASE);
+    }
+}
+
+/* Tear down this thread's ring. SQEs queued but never submitted die with
+ * the fd; submitted ones are drained first, and if that fails the ring
+ * and its result buffers are abandoned rather than freed under the
+ * kernel's feet. */
+void ring_free(void)
+{
+    StatRing *r = stat_ring;
+    if (!r) return;
+    stat_ring = NULL;
+    ring_drain(r);
+    if (r->inflight > 0) return;
+    if (r->sqes && r->sqes != MAP_FAILED) munmap(r->sqes, r->sqes_len);
+    if (r->cq_len && r->cq_ptr && r->cq_ptr != MAP_FAILED) munmap(r->cq_ptr, r->cq_len);
+    if (r->sq_ptr && r->sq_ptr != MAP_FAILED) munmap(r->sq_ptr, r->sq_len);
+    close(r->fd);
+    free(r);
+}
+
+/* Queue one STATX per name, submit them with a single io_uring_enter and
+ * wait for all completions. res[i] receives 0 or -errno. */
+static int ring_statx(StatRing *r, int dirfd, FileEntry *entries, const size_t *idx,
+                      size_t n, unsigned int mask, int *res)
+{
+    unsigned tail = *r->sq_tail;
+    for (size_t i = 0; i < n; i++)
+    {
+        unsigned slot = tail & *r->sq_mask;
+        struct io_uring_sqe *sqe = &r->sqes[slot];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_STATX;
+        sqe->fd = dirfd;
+        sqe->addr = (unsigned long)entries[idx[i]].name;
+        sqe->len = mask;
+        sqe->off = (unsigned long)&r->results[i];
+        sqe->statx_flags = (unsigned)meta_flags;
+        sqe->user_data = i;
+        r->sq_array[slot] = slot;
+        tail++;
+    }
+    __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+
+    size_t reaped = 0;
+    unsigned to_submit = (unsigned)n;
+    while (reaped < n)
+    {
+        /* Statx completes asynchronously: wait for everything still out
+         * in one call instead of returning after the first completion */
+        long ret = syscall(__NR_io_uring_enter, r->fd, to_submit, (unsigned)(n - reaped),
+                           IORING_ENTER_GETEVENTS, NULL, 0);
+        stats_count(SC_URING_ENTER, 1);
+        if (ret < 0)
+        {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        to_submit -= (unsigned)ret;
+        r->inflight += (unsigned)ret;
+
+        unsigned head = *r->cq_head;
+        unsigned ctail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != ctail; head++)
+        {
+            struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+            res[cqe->user_data] = cqe->res;
+            reaped++;
+            r->inflight--;
+        }
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+#endif
+
+/* Stat entries[pending[0..npending)] relative to `dirfd`. ok[i] is set to
+ * 1 when pending[i] was filled in. With --uring the whole getdents batch
+ * goes to the kernel in RING_ENTRIES-sized submissions; otherwise, or if
+ * the kernel rejects the ring or the opcode, each entry is stat'ed
+ * synchronously. Returns the number of entries filled. */
+size_t stat_batch(int dirfd, FileEntry *entries, size_t *pending, size_t npending,
+                  unsigned int mask, int *ok)
+{
+    size_t filled = 0;
+    size_t done = 0;
+    int prev = stats_enter(PH_STAT);
+
+#ifdef HAVE_URING
+    StatRing *r = use_uring ? ring_get() : NULL;
+    while (r && done < npending)
+    {
+        size_t n = npending - done;
+        if (n > RING_ENTRIES) n = RING_ENTRIES;
+
+        int res[RING_ENTRIES];
+        uint64_t t0 = stats_clock();
+        if (ring_statx(r, dirfd, entries, pending + done, n, mask, res) == -1)
+        {
+            /* Ring state is unknown now; finish this run synchronously */
+            ring_free();
+            use_uring = 0;
+            break;
+        }
+        /* Per-entry latency is not visible through the ring; each entry
+         * is recorded at the batch average */
+        stats_latency(stats.hist_stat, t0, n);
+
+        for (size_t i = 0; i < n; i++)
+        {
+            FileEntry *e = &entries[pending[done + i]];
+            struct stat st;
+            ok[done + i] = 0;
+            if (res[i] == 0)
+                statx_to_stat(&r->results[i], &st);
+            else if (res[i] != -EINVAL && res[i] != -EOPNOTSUPP)
+                continue;
+            /* Kernel without IORING_OP_STATX: do this one synchronously */
+            else if (meta_stat(dirfd, e->name, mask, &st) == -1)
+                continue;
+            entry_fill_stat(e, &st);
+            ok[done + i] = 1;
+            filled++;
+        }
+        done += n;
+    }
+#endif
+
+    for (; done < npending; done++)
+    {
+        FileEntry *e = &entries[pending[done]];
+        struct stat st;
+        ok[done] = (meta_stat(dirfd, e->name, mask, &st) == 0);
+        if (!ok[done]) continue;
+        entry_fill_stat(e, &st);
+        filled++;
+    }
+    stats_leave(prev);
+    return filled;
+}
+
+/* Copy the fields the listings use out of a stat result */
+void entry_fill_stat(FileEntry *e, const struct stat *st)
+{
+    e->mode = st->st_mode;
+    e->size = st->st_size;
+    e->is_symlink = S_ISLNK(st->st_mode);
+    e->nlink = st->st_nlink;
+    e->uid = st->st_uid;
+    e->gid = st->st_gid;
+    e->mtime = st->st_mtime;
+    e->ctime = st->st_ctime;
+    e->atime = st->st_atime;
+    e->mtime_nsec = (uint32_t)st->st_mtim.tv_nsec;
+    e->ctime_nsec = (uint32_t)st->st_ctim.tv_nsec;
+    e->atime_nsec = (uint32_t)st->st_atim.tv_nsec;
+    e->ino = st->st_ino;
+    e->blocks = st->st_blocks;
+}
+
+/* Decide whether the dirent's d_type already says everything the short
+ * and -x listings need. Only regular files that could be colored as
+ * executables, and entries of unknown type, have to be stat'ed.
+ * `ext_colored` says the name already has an extension color. */
+int dtype_needs_stat(const struct linux_dirent64 *d, int long_flag, int ext_colored)
+{
+    if (long_flag || sort_mask) return 1;
+
+    switch (d->d_type)
+    {
+    case DT_DIR: case DT_LNK: case DT_CHR: case DT_BLK: case DT_FIFO: case DT_SOCK:
+        return 0;
+    case DT_REG:
+        /* Extension colors win over the execute bits */
+        return color_enabled && !ext_colored;
+    default:
+        return 1;
+    }
+}
+
+/* ---------- Timestamp Formatter ---------- */
+
+/* Fill `slot` with the local day containing `t`. Days that contain a DST
+ * switch are left uncached, since hour and minute cannot be derived from
+ * the distance to midnight there. Returns 0 in that case. */
+static int time_slot_fill(TimeSlot *slot, time_t t, const struct tm *tm)
+{
+    int year = tm->tm_year + 1900;
+    if (year < 0 || year > 9999)
+    {
+        slot->day_end = 0;
+        return 0;
+    }
+
+    time_t start = t - (tm->tm_hour * 3600 + tm->tm_min * 60 + tm->tm_sec);
+    time_t end = start + 24 * 3600;
+
+    struct tm a, b;
+    localtime_r(&start, &a);
+    time_t last = end - 1;
+    localtime_r(&last, &b);
+    if (a.tm_gmtoff != tm->tm_gmtoff || b.tm_gmtoff != tm->tm_gmtoff)
+    {
+        slot->day_end = 0;
+        return 0;
+    }
+
+    slot->day_start = start;
+    slot->day_end = end;
+    strftime(slot->date, sizeof(slot->date), "%b %e ", tm);
+    slot->year[0] = ' ';
+    for (int i = 4; i >= 1; i--, year /= 10)
+        slot->year[i] = (char)('0' + year % 10);
+    slot->year[5] = '\0';
+    return 1;
+}
+
+/* Write the TIME_LEN-byte -l timestamp for `t` into `buf` (not NUL
+ * terminated): "%b %e %H:%M" within the last six months, otherwise
+ * "%b %e  %Y". */
+void format_time(time_t t, char *buf)
+{
+    TimeCache *tc = &time_cache;
+    if (tc->now == 0) tc->now = time(NULL);
+    /* Something newer than our clock: look again before calling it future */
+    if (t > tc->now) tc->now = time(NULL);
+    int recent = t > tc->now - SIX_MONTHS && t <= tc->now;
+
+    TimeSlot *slot = &tc->slots[(unsigned long long)((t + tc->gmtoff) / (24 * 3600)) % TIME_SLOTS];
+    if (!(slot->day_end && t >= slot->day_start && t < slot->day_end))
+    {
+        struct tm tm;
+        if (!localtime_r(&t, &tm))
+        {
+            memcpy(buf, "???????????", TIME_LEN - 1);
+            buf[TIME_LEN - 1] = '?';
+            return;
+        }
+        tc->gmtoff = tm.tm_gmtoff;
+        slot = &tc->slots[(unsigned long long)((t + tc->gmtoff) / (24 * 3600)) % TIME_SLOTS];
+        if (!time_slot_fill(slot, t, &tm))
+        {
+            char tmp[TIME_LEN + 8];
+            strftime(tmp, sizeof(tmp), recent ? "%b %e %H:%M" : "%b %e  %Y", &tm);
+            memcpy(buf, tmp, TIME_LEN);
+            return;
+        }
+    }
+
+    memcpy(buf, slot->date, 7);
+    if (!recent)
+    {
+        memcpy(buf + 7, slot->year, 5);
+        return;
+    }
+    int secs = (int)(t - slot->day_start);
+    int hh = secs / 3600, mm = secs / 60 % 60;
+    buf[7] = (char)('0' + hh / 10);
+    buf[8] = (char)('0' + hh % 10);
+    buf[9] = ':';
+    buf[10] = (char)('0' + mm / 10);
+    buf[11] = (char)('0' + mm % 10);
+}
+
+/* ---------- Output Writer ---------- */
+void out_init_fd(OutBuf *o, int fd)
+{
+    o->buf = malloc(OUTBUF_SIZE);
+    if (!o->buf)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    o->len = 0;
+    o->cap = OUTBUF_SIZE;
+    o->fd = fd;
+    o->line_buffered = isatty(fd);
+}
+
+void out_init_mem(OutBuf *o)
+{
+    memset(o, 0, sizeof(*o));
+    o->fd = -1;
+}
+
+static void out_write_fd(int fd, const char *s, size_t n)
+{
+    int prev = stats_enter(PH_WRITE);
+    while (n > 0)
+    {
+        ssize_t w = write(fd, s, n);
+        stats_count(SC_WRITE, 1);
+        if (w == -1)
+        {
+            if (errno == EINTR) continue;
+            perror("write");
+            exit(EXIT_FAILURE);
+        }
+        s += w;
+        n -= (size_t)w;
+    }
+    stats_leave(prev);
+}
+
+void out_flush(OutBuf *o)
+{
+    if (o->fd == -1 || o->len == 0) return;
+    out_write_fd(o->fd, o->buf, o->len);
+    o->len = 0;
+}
+
+/* Make room for `n` more bytes: flush an fd writer, grow a memory one */
+static void out_reserve(OutBuf *o, size_t n)
+{
+    if (o->cap - o->len >= n) return;
+    if (o->fd != -1)
+    {
+        out_flush(o);
+        if (o->cap >= n) return;
+    }
+    size_t cap = o->cap ? o->cap : 4096;
+    while (cap - o->len < n) cap *= 2;
+    o->buf = realloc(o->buf, cap);
+    if (!o->buf)
+    {
+        perror("realloc");
+        exit(EXIT_FAILURE);
+    }
+    o->cap = cap;
+}
+
+void out_write(OutBuf *o, const char *s, size_t n)
+{
+    if (o->fd != -1 && n >= o->cap)
+    {
+        /* Too big to be worth copying: hand it straight to the kernel */
+        out_flush(o);
+        out_write_fd(o->fd, s, n);
+        return;
+    }
+    out_reserve(o, n);
+    memcpy(o->buf + o->len, s, n);
+    o->len += n;
+    if (o->line_buffered && memchr(s, '\n', n)) out_flush(o);
+}
+
+void out_str(OutBuf *o, const char *s)
+{
+    out_write(o, s, strlen(s));
+}
+
+void out_putc(OutBuf *o, char c)
+{
+    if (o->len == o->cap) out_reserve(o, 1);
+    o->buf[o->len++] = c;
+    if (c == '\n' && o->line_buffered) out_flush(o);
+}
+
+void out_pad(OutBuf *o, int n)
+{
+    if (n <= 0) return;
+    out_reserve(o, (size_t)n);
+    memset(o->buf + o->len, ' ', (size_t)n);
+    o->len += (size_t)n;
+}
+
+/* Decimal `v` right-aligned in `width` columns, like "%*lld" */
+void out_num(OutBuf *o, long long v, int width)
+{
+    char tmp[24];
+    char *p = tmp + sizeof(tmp);
+    unsigned long long u = v < 0 ? -(unsigned long long)v : (unsigned long long)v;
+    do
+    {
+        *--p = (char)('0' + u % 10);
+        u /= 10;
+    } while (u);
+    if (v < 0) *--p = '-';
+
+    int len = (int)(tmp + sizeof(tmp) - p);
+    out_pad(o, width - len);
+    out_write(o, p, (size_t)len);
+}
+
+void out_free(OutBuf *o)
+{
+    free(o->buf);
+    o->buf = NULL;
+    o->len = o->cap = 0;
+}
+
+/* ---------- Record Output ---------- */
+
+/* Length of the well-formed UTF-8 sequence at s, or 0 */
+static size_t utf8_seq_len(const unsigned char *s, size_t n)
+{
+    unsigned char c = s[0];
+    size_t len = c >= 0xc2 && c <= 0xdf ? 2 : c >= 0xe0 && c <= 0xef ? 3 :
+                 c >= 0xf0 && c <= 0xf4 ? 4 : 0;
+    if (len == 0 || n < len) return 0;
+    for (size_t i = 1; i < len; i++)
+        if ((s[i] & 0xc0) != 0x80) return 0;
+    /* Overlong forms, UTF-16 surrogates and code points past U+10FFFF */
+    if ((c == 0xe0 && s[1] < 0xa0) || (c == 0xed && s[1] >= 0xa0) ||
+        (c == 0xf0 && s[1] < 0x90) || (c == 0xf4 && s[1] >= 0x90))
+        return 0;
+    return len;
+}
+
+/* `s` as a JSON string, written straight into the buffer. Names are
+ * bytes, not text: a byte that is not part of valid UTF-8 becomes the
+ * lone surrogate \udcXX, which surrogateescape decoders map back. */
+static char *json_string(char *p, const char *s, size_t len)
+{
+    static const char hex[] = "0123456789abcdef";
+    const unsigned char *u = (const unsigned char *)s;
+    *p++ = '"';
+    for (size_t i = 0; i < len; )
+    {
+        size_t end = i + ascii_prefix(s + i, len - i);
+        for (; i < end; i++)
+        {
+            unsigned char c = u[i];
+            if (c >= 0x20 && c != '"' && c != '\\')
+            {
+                *p++ = (char)c;
+                continue;
+            }
+            *p++ = '\\';
+            if (c == '"' || c == '\\') *p++ = (char)c;
+            else if (c == '\n') *p++ = 'n';
+            else if (c == '\t') *p++ = 't';
+            else
+            {
+                memcpy(p, "u00", 3);
+                p[3] = hex[c >> 4];
+                p[4] = hex[c & 15];
+                p += 5;
+            }
+        }
+        if (i == len) break;
+
+        size_t n = utf8_seq_len(u + i, len - i);
+        if (n)
+        {
+            memcpy(p, s + i, n);
+            p += n;
+            i += n;
+        }
+        else
+        {
+            memcpy(p, "\\udc", 4);
+            p[4] = hex[u[i] >> 4];
+            p[5] = hex[u[i] & 15];
+            p += 6;
+            i++;
+        }
+    }
+    *p++ = '"';
+    return p;
+}
+
+static char *json_num(char *p, long long v)
+{
+    char tmp[24];
+    char *q = tmp + sizeof(tmp);
+    unsigned long long u = v < 0 ? -(unsigned long long)v : (unsigned long long)v;
+    do
+    {
+        *--q = (char)('0' + u % 10);
+        u /= 10;
+    } while (u);
+    if (v < 0) *--q = '-';
+    size_t n = (size_t)(tmp + sizeof(tmp) - q);
+    memcpy(p, q, n);
+    return p + n;
+}
+
+#define JSON_KEY(p, k) (memcpy((p), k, sizeof(k) - 1), (p) + sizeof(k) - 1)
+
+static void bin_record(OutBuf *out, uint32_t type, const FileEntry *e, const char *name, size_t len)
+{
+    BinRecord r;
+    memset(&r, 0, sizeof(r));
+    r.len = htole32((uint32_t)(sizeof(r) + len));
+    r.type = htole32(type);
+    if (e)
+    {
+        r.mode = htole32((uint32_t)e->mode);
+        r.uid = htole32((uint32_t)e->uid);
+        r.gid = htole32((uint32_t)e->gid);
+        r.nlink = htole64((uint64_t)e->nlink);
+        r.size = (int64_t)htole64((uint64_t)e->size);
+        r.blocks = (int64_t)htole64((uint64_t)e->blocks);
+        r.mtime = (int64_t)htole64((uint64_t)e->mtime);
+        r.ctime = (int64_t)htole64((uint64_t)e->ctime);
+    }
+    out_reserve(out, sizeof(r) + len);
+    memcpy(out->buf + out->len, &r, sizeof(r));
+    memcpy(out->buf + out->len + sizeof(r), name, len);
+    out->len += sizeof(r) + len;
+}
+
+/* What starts a directory's listing: "path:" in text, a record otherwise */
+void print_dir_header(OutBuf *out, const char *path)
+{
+    size_t len = strlen(path);
+    if (out_format == FMT_TEXT)
+    {
+        out_write(out, path, len);
+        out_str(out, ":\n");
+    }
+    else if (out_format == FMT_NDJSON)
+    {
+        out_reserve(out, len * 6 + 16);
+        char *p = out->buf + out->len;
+        p = JSON_KEY(p, "{\"dir\":");
+        p = json_string(p, path, len);
+        p = JSON_KEY(p, "}\n");
+        out->len = (size_t)(p - out->buf);
+        if (out->line_buffered) out_flush(out);
+    }
+    else
+    {
+        bin_record(out, REC_DIR, NULL, path, len);
+    }
+}
+
+/* One entry as an ndjson or binary record. The record is formatted in
+ * place in the output buffer: no mode string, no time formatting, no
+ * user or group lookups. */
+void print_record(OutBuf *out, const FileEntry *e)
+{
+    if (out_format == FMT_BINARY)
+    {
+        bin_record(out, REC_ENTRY, e, e->name, e->name_len);
+        return;
+    }
+
+    /* Escaped name plus nine keys and numbers of at most 20 digits */
+    out_reserve(out, e->name_len * 6 + 320);
+    char *p = out->buf + out->len;
+    p = JSON_KEY(p, "{\"name\":");
+    p = json_string(p, e->name, e->name_len);
+    p = json_num(JSON_KEY(p, ",\"mode\":"), (long long)e->mode);
+    p = json_num(JSON_KEY(p, ",\"size\":"), (long long)e->size);
+    p = json_num(JSON_KEY(p, ",\"nlink\":"), (long long)e->nlink);
+    p = json_num(JSON_KEY(p, ",\"uid\":"), (long long)e->uid);
+    p = json_num(JSON_KEY(p, ",\"gid\":"), (long long)e->gid);
+    p = json_num(JSON_KEY(p, ",\"blocks\":"), (long long)e->blocks);
+    p = json_num(JSON_KEY(p, ",\"mtime\":"), (long long)e->mtime);
+    p = json_num(JSON_KEY(p, ",\"ctime\":"), (long long)e->ctime);
+    p = JSON_KEY(p, "}\n");
+    out->len = (size_t)(p - out->buf);
+    if (out->line_buffered) out_flush(out);
+}
+
+/* ---------- Arena Allocator ---------- */
+
+/* 16-byte aligned bump allocation; exits on out-of-memory like the
+ * other allocation paths of the walk */
+void *arena_alloc(Arena *a, size_t n)
+{
+    n = (n + 15) & ~(size_t)15;
+    ArenaChunk *c = a->cur;
+    if (c && c->size - c->used >= n)
+    {
+        void *p = c->data + c->used;
+        c->used += n;
+        return p;
+    }
+
+    /* Reuse the next retained chunk when it is big enough */
+    ArenaChunk *next = c ? c->next : a->first;
+    if (!next || next->size < n)
+    {
+        size_t size = n > ARENA_CHUNK ? n : ARENA_CHUNK;
+        ArenaChunk *fresh = malloc(sizeof(ArenaChunk) + size);
+        if (!fresh)
+        {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+        fresh->size = size;
+        fresh->next = next;
+        if (c) c->next = fresh;
+        else a->first = fresh;
+        next = fresh;
+    }
+    next->used = n;
+    a->cur = next;
+    return next->data;
+}
+
+/* Resize the most recent allocation `p`, in place when the chunk has room */
+void *arena_grow(Arena *a, void *p, size_t old_n, size_t new_n)
+{
+    ArenaChunk *c = a->cur;
+    size_t old_al = (old_n + 15) & ~(size_t)15;
+    size_t new_al = (new_n + 15) & ~(size_t)15;
+    if (p && c && (char *)p + old_al == c->data + c->used &&
+        c->used - old_al + new_al <= c->size)
+    {
+        c->used = c->used - old_al + new_al;
+        return p;
+    }
+    void *q = arena_alloc(a, new_n);
+    if (p) memcpy(q, p, old_n);
+    return q;
+}
+
+char *arena_strdup(Arena *a, const char *s)
+{
+    return arena_strndup(a, s, strlen(s));
+}
+
+/* Copy `len` bytes of `s` and terminate them */
+char *arena_strndup(Arena *a, const char *s, size_t len)
+{
+    char *p = arena_alloc(a, len + 1);
+    memcpy(p, s, len);
+    p[len] = '\0';
+    return p;
+}
+
+ArenaMark arena_mark(Arena *a)
+{
+    ArenaMark m = { a->cur, a->cur ? a->cur->used : 0 };
+    return m;
+}
+
+/* Drop everything allocated since `m` in one step */
+void arena_release(Arena *a, ArenaMark m)
+{
+    a->cur = m.chunk;
+    if (m.chunk) m.chunk->used = m.used;
+}
+
+void arena_free(Arena *a)
+{
+    ArenaChunk *c = a->first;
+    while (c)
+    {
+        ArenaChunk *next = c->next;
+        free(c);
+        c = next;
+    }
+    a->first = a->cur = NULL;
+}
+
+/* "dir/name" in a fresh heap buffer; display paths are not bounded by PATH_MAX */
+char *join_path(const char *dir, const char *name)
+{
+    size_t plen = strlen(dir), nlen = strlen(name);
+    char *p = malloc(plen + nlen + 2);
+    if (!p) return NULL;
+    memcpy(p, dir, plen);
+    p[plen] = '/';
+    memcpy(p + plen + 1, name, nlen + 1);
+    return p;
+}
+
+int is_descendable(const FileEntry *e)
+{
+    return S_ISDIR(e->mode) && strcmp(e->name, ".") != 0 && strcmp(e->name, "..") != 0;
+}
+
+void entry_list_init(EntryList *l)
+{
+    memset(l, 0, sizeof(*l));
+    l->cap = 128;
+    l->entries = arena_alloc(&entry_arena, l->cap * sizeof(FileEntry));
+}
+
+void entry_list_done(EntryList *l)
+{
+    free(l->pending);
+    free(l->ok);
+}
+
+/* Append the visible entries of the current getdents batch to `l` and
+ * capture their metadata. Entries that need a stat are handed to
+ * stat_batch() together; entries that vanish before the stat are dropped.
+ * The array and names come from this thread's arenas. */
+void read_batch(DirReader *dr, int long_flag, EntryList *l)
+{
+    size_t batch_start = l->count, npending = 0;
+    struct linux_dirent64 *entry;
+    int prev = stats_enter(PH_READ);
+
+    while ((entry = dir_next(dr)) != NULL)
+    {
+        if (entry->d_name[0] == '.' && !show_all) continue;
+
+        if (l->count + 1 >= l->cap)
+        {
+            l->entries = arena_grow(&entry_arena, l->entries, l->cap * sizeof(FileEntry),
+                                    2 * l->cap * sizeof(FileEntry));
+            l->cap *= 2;
+        }
+
+        FileEntry *e = &l->entries[l->count];
+        size_t len = strlen(entry->d_name);
+        e->name = arena_strndup(&name_arena, entry->d_name, len);
+        e->name_len = len;
+        e->name_width = name_width(e->name, len);
+        e->color = color_enabled ? color_for_ext(e->name, len) : 0;
+        if (dtype_needs_stat(entry, long_flag, e->color != 0))
+        {
+            if (npending == l->pcap)
+            {
+                l->pcap = l->pcap ? l->pcap * 2 : 256;
+                l->pending = realloc(l->pending, l->pcap * sizeof(size_t));
+                l->ok = realloc(l->ok, l->pcap * sizeof(int));
+                if (!l->pending || !l->ok)
+                {
+                    perror("realloc");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            l->pending[npending++] = l->count;
+        }
+        else
+        {
+            struct stat st;
+            memset(&st, 0, sizeof(st));
+            st.st_mode = DTTOIF(entry->d_type);
+            st.st_ino = entry->d_ino;
+            entry_fill_stat(e, &st);
+        }
+        l->count++;
+    }
+
+    if (npending > 0 &&
+        stat_batch(dr->fd, l->entries, l->pending, npending, meta_mask_for(long_flag), l->ok) != npending)
+    {
+        /* Squeeze out the entries whose stat failed */
+        for (size_t i = 0; i < npending; i++)
+            if (!l->ok[i]) l->entries[l->pending[i]].name = NULL;
+        size_t kept = batch_start;
+        for (size_t i = batch_start; i < l->count; i++)
+            if (l->entries[i].name) l->entries[kept++] = l->entries[i];
+        l->count = kept;
+    }
+
+    if (color_enabled)
+        for (size_t i = batch_start; i < l->count; i++)
+            color_classify(&l->entries[i], dr->fd);
+    stats_leave(prev);
+}
+
+/* Read every visible entry of an open directory. Callers take an
+ * arena_mark() first and release it when the directory is done. */
+size_t read_entries(DirReader *dr, int long_flag, FileEntry **out)
+{
+    EntryList l;
+    entry_list_init(&l);
+
+    ssize_t nread;
+    while ((nread = dir_fill(dr)) > 0)
+        read_batch(dr, long_flag, &l);
+    if (nread == -1) perror("getdents64 failed");
+
+    entry_list_done(&l);
+    *out = l.entries;
+    return l.count;
+}
+
+/* Print entries that are already in listing order */
+void render_sorted(OutBuf *out, FileEntry *entries, size_t count, int long_flag, int horizontal_flag)
+{
+    if (count == 0)
+    {
+        if (out_format == FMT_TEXT) out_putc(out, '\n');
+        return;
+    }
+
+    int prev = stats_enter(PH_RENDER);
+
+    if (out_format != FMT_TEXT)
+    {
+        for (size_t i = 0; i < count; i++)
+            print_record(out, &entries[i]);
+    }
+    else if (long_flag)
+    {
+        for (size_t i = 0; i < count; i++)
+            print_long_entry(out, &entries[i]);
+    }
+    else if (horizontal_flag)
+    {
+        display_horizontal(out, entries, (int)count);
+    }
+    else if (one_per_line)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            print_colored_padded(out, &entries[i], 0);
+            out_putc(out, '\n');
+        }
+    }
+    else
+    {
+        display_vertical(out, entries, (int)count);
+    }
+    stats_leave(prev);
+}
+
+void name_list_add(NameList *nl, const char *name)
+{
+    if (nl->count == nl->cap)
+    {
+        nl->cap = nl->cap ? nl->cap * 2 : 16;
+        nl->names = realloc(nl->names, nl->cap * sizeof(char *));
+        if (!nl->names)
+        {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    nl->names[nl->count] = strdup(name);
+    if (!nl->names[nl->count])
+    {
+        perror("strdup");
+        exit(EXIT_FAILURE);
+    }
+    nl->count++;
+}
+
+void name_list_free(NameList *nl)
+{
+    for (size_t i = 0; i < nl->count; i++)
+        free(nl->names[i]);
+    free(nl->names);
+    memset(nl, 0, sizeof(*nl));
+}
+
+/* -U: print each getdents batch as soon as it is stat'ed, in directory
+ * order. Only one batch of entries is held at a time; -x rows are laid
+ * out with the widest name seen so far. */
+static void stream_entries(DirReader *dr, OutBuf *out, int long_flag, int horizontal_flag,
+                           NameList *subdirs)
+{
+    EntryList l;
+    entry_list_init(&l);
+    ArenaMark batch_mark = arena_mark(&name_arena);
+
+    int term_width = get_term_width();
+    int col_width = 0, curr_width = 0, pad_owed = 0;
+    size_t total = 0;
+
+    ssize_t nread;
+    while ((nread = dir_fill(dr)) > 0)
+    {
+        l.count = 0;
+        arena_release(&name_arena, batch_mark);
+        read_batch(dr, long_flag, &l);
+        total += l.count;
+
+        int prev = stats_enter(PH_RENDER);
+        for (size_t i = 0; i < l.count; i++)
+        {
+            FileEntry *e = &l.entries[i];
+            if (out_format != FMT_TEXT)
+            {
+                print_record(out, e);
+            }
+            else if (long_flag)
+            {
+                print_long_entry(out, e);
+            }
+            else if (horizontal_flag)
+            {
+                int len = e->name_width;
+                if (len + COL_GAP > col_width) col_width = len + COL_GAP;
+                if (curr_width > 0 && curr_width + col_width > term_width)
+                {
+                    out_putc(out, '\n');
+                    curr_width = 0;
+                }
+                /* The previous name is padded only once this one joins its row */
+                else if (curr_width > 0)
+                {
+                    out_pad(out, pad_owed);
+                }
+                print_colored_padded(out, e, 0);
+                pad_owed = col_width - len;
+                curr_width += col_width;
+            }
+            else
+            {
+                print_colored_padded(out, e, 0);
+                out_putc(out, '\n');
+            }
+            if (subdirs && is_descendable(e)) name_list_add(subdirs, e->name);
+        }
+        stats_leave(prev);
+    }
+    if (nread == -1) perror("getdents64 failed");
+
+    if (out_format == FMT_TEXT && (total == 0 || (horizontal_flag && !long_flag)))
+        out_putc(out, '\n');
+    entry_list_done(&l);
+}
+
+/* Read and print one open directory. With `subdirs`, the names of the
+ * subdirectories to descend into are collected in listing order; the
+ * entries themselves are released before this returns. With `du`, the
+ * entries are added to it instead of printed. */
+void list_directory(DirReader *dr, OutBuf *out, int long_flag, int horizontal_flag,
+                    NameList *subdirs, DuTotal *du)
+{
+    ArenaMark name_mark = arena_mark(&name_arena);
+    ArenaMark entry_mark = arena_mark(&entry_arena);
+
+    if (unsorted_flag)
+    {
+        stream_entries(dr, out, long_flag, horizontal_flag, subdirs);
+    }
+    else
+    {
+        FileEntry *entries;
+        size_t count;
+        struct stat dst;
+        unsigned int flags = (long_flag ? CACHE_F_LONG : 0) | (show_all ? CACHE_F_ALL : 0) |
+                             (color_enabled ? CACHE_F_COLOR : 0);
+        /* Snapshots are kept in name order and carry no atime or inode */
+        int cacheable = cache_dir && time_field != TIME_ATIME && !du && fstat(dr->fd, &dst) == 0;
+        int hit = 0;
+        if (cacheable)
+        {
+            int prev = stats_enter(PH_READ);
+            hit = (cache_load(dr->fd, &dst, flags, &entries, &count) == 0);
+            stats_leave(prev);
+        }
+
+        if (!hit)
+        {
+            count = read_entries(dr, long_flag, &entries);
+            int prev = stats_enter(PH_SORT);
+            if (count > 0) sort_entries_by_name(entries, count);
+            stats_leave(prev);
+            if (cacheable) cache_store(&dst, flags, entries, count);
+        }
+        int prev = stats_enter(PH_SORT);
+        order_entries(entries, count);
+        stats_leave(prev);
+        if (du) du_add_entries(du, entries, count);
+        else render_sorted(out, entries, count, long_flag, horizontal_flag);
+        for (size_t i = 0; subdirs && i < count; i++)
+            if (is_descendable(&entries[i])) name_list_add(subdirs, entries[i].name);
+    }
+
+    arena_release(&entry_arena, entry_mark);
+    arena_release(&name_arena, name_mark);
+}
+
+/* ---------- Listing Cache ---------- */
+
+/* Pick the cache directory: DIR, else $XDG_CACHE_HOME/ls, else
+ * ~/.cache/ls. The cache stays off if it cannot be created, or if it
+ * is not a directory of ours that only we can write: snapshots are
+ * printed as listings, so nobody else may plant them. */
+void cache_init(const char *dir)
+{
+    char *path = NULL;
+    const char *xdg = getenv("XDG_CACHE_HOME"), *home = getenv("HOME");
+    int rc;
+
+    if (dir) rc = asprintf(&path, "%s", dir);
+    else if (xdg && *xdg) rc = asprintf(&path, "%s/ls", xdg);
+    else if (home && *home) rc = asprintf(&path, "%s/.cache/ls", home);
+    else rc = -1;
+    if (rc == -1)
+    {
+        fprintf(stderr, "--cache: no cache directory, caching disabled\n");
+        return;
+    }
+
+    /* Create the missing components, private to the user */
+    for (char *p = path + 1; ; p++)
+    {
+        if (*p != '/' && *p != '\0') continue;
+        char c = *p;
+        *p = '\0';
+        if (mkdir(path, 0700) == -1 && errno != EEXIST)
+        {
+            fprintf(stderr, "--cache: cannot create %s: %s, caching disabled\n", path, strerror(errno));
+            free(path);
+            return;
+        }
+        *p = c;
+        if (c == '\0') break;
+    }
+    struct stat st;
+    if (stat(path, &st) == -1 || !S_ISDIR(st.st_mode) || st.st_uid != geteuid() ||
+        (st.st_mode & (S_IWGRP | S_IWOTH)))
+    {
+        fprintf(stderr, "--cache: %s is not a private directory of this user, caching disabled\n", path);
+        free(path);
+        return;
+    }
+    free(cache_dir);
+    cache_dir = path;
+}
+
+static uint64_t cache_checksum(const unsigned char *p, size_t n)
+{
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = 0; i < n; i++)
+        h = (h ^ p[i]) * 1099511628211ull;
+    return h;
+}
+
+static int cache_path(char *buf, size_t n, const struct stat *dst, unsigned int flags)
+{
+    int len = snprintf(buf, n, "%s/%llx-%llx-%x.lsc", cache_dir, (unsigned long long)dst->st_dev,
+                       (unsigned long long)dst->st_ino, flags);
+    return len > 0 && (size_t)len < n ? 0 : -1;
+}
+
+/* Read into `buf` until `n` bytes or EOF; returns the bytes read */
+static size_t read_full(int fd, void *buf, size_t n)
+{
+    size_t got = 0;
+    while (got < n)
+    {
+        ssize_t r = read(fd, (char *)buf + got, n - got);
+        if (r == -1 && errno == EINTR) continue;
+        if (r <= 0) break;
+        got += (size_t)r;
+    }
+    return got;
+}
+
+/* Look up the snapshot for the directory `dst` and rebuild its sorted
+ * entries in this thread's arenas. A hit needs the same device, inode,
+ * mtime and ctime as the snapshot, so no entry was added, removed or
+ * renamed since. Entries change their own inode without touching the
+ * directory, so listings that show more than the file type re-stat
+ * every entry. Plain listings only re-stat those whose ctime was within
+ * CACHE_RACY seconds of the snapshot: a type change is a rename, which
+ * the directory does record. Returns 0 on a hit, -1 on a miss. */
+int cache_load(int dirfd, const struct stat *dst, unsigned int flags, FileEntry **out, size_t *count)
+{
+    char path[PATH_MAX];
+    if (cache_path(path, sizeof(path), dst, flags) == -1) return -1;
+
+    int fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd == -1) return -1;
+    /* Only snapshots this user wrote, and nobody else could rewrite */
+    struct stat cst;
+    if (fstat(fd, &cst) == -1 || !S_ISREG(cst.st_mode) || cst.st_uid != geteuid() ||
+        (cst.st_mode & (S_IWGRP | S_IWOTH)) ||
+        cst.st_size < (off_t)sizeof(CacheHeader) || cst.st_size > CACHE_FILE_MAX)
+    {
+        close(fd);
+        return -1;
+    }
+    size_t size = (size_t)cst.st_size;
+    unsigned char *buf = malloc(size);
+    if (!buf || read_full(fd, buf, size) != size)
+    {
+        free(buf);
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    CacheHeader h;
+    memcpy(&h, buf, sizeof(h));
+    const unsigned char *payload = buf + sizeof(h);
+    size_t payload_len = size - sizeof(h);
+    unsigned int mask = meta_mask_for(flags & CACHE_F_LONG);
+    if (h.magic != CACHE_MAGIC || h.version != CACHE_VERSION || h.flags != flags ||
+        (h.mask & mask) != mask ||
+        h.dev != (uint64_t)dst->st_dev || h.ino != (uint64_t)dst->st_ino ||
+        h.mtime_sec != dst->st_mtim.tv_sec || h.mtime_nsec != dst->st_mtim.tv_nsec ||
+        h.ctime_sec != dst->st_ctim.tv_sec || h.ctime_nsec != dst->st_ctim.tv_nsec ||
+        h.written + CACHE_MAX_AGE < time(NULL) ||
+        h.count > payload_len / sizeof(CacheRecord) ||
+        h.count * sizeof(CacheRecord) + h.names_len != payload_len ||
+        cache_checksum(payload, payload_len) != h.checksum)
+    {
+        free(buf);
+        return -1;
+    }
+
+    const unsigned char *names = payload + h.count * sizeof(CacheRecord);
+    size_t name_off = 0;
+    FileEntry *entries = arena_alloc(&entry_arena, (h.count ? h.count : 1) * sizeof(FileEntry));
+    size_t *pending = malloc((h.count ? h.count : 1) * sizeof(size_t));
+    int *ok = malloc((h.count ? h.count : 1) * sizeof(int));
+    if (!pending || !ok)
+    {
+        free(pending);
+        free(ok);
+        free(buf);
+        return -1;
+    }
+    size_t npending = 0;
+
+    /* Appending, chmod and chown leave the directory alone, so whatever
+     * the listing shows beyond the file type is re-stat'ed on every hit.
+     * The snapshot still saves the getdents, the sort and the names. */
+    int restat_all = (flags & CACHE_F_COLOR) || (mask & ~(META_MASK_SHORT | STATX_CTIME));
+
+    for (size_t i = 0; i < h.count; i++)
+    {
+        CacheRecord r;
+        memcpy(&r, payload + i * sizeof(CacheRecord), sizeof(r));
+        if (r.name_len >= h.names_len - name_off || names[name_off + r.name_len] != '\0')
+        {
+            free(pending);
+            free(ok);
+            free(buf);
+            return -1;
+        }
+
+        FileEntry *e = &entries[i];
+        e->name = arena_strndup(&name_arena, (const char *)names + name_off, r.name_len);
+        name_off += r.name_len + 1;
+        e->name_len = r.name_len;
+        e->name_width = name_width(e->name, e->name_len);
+        e->mode = r.mode;
+        e->size = r.size;
+        e->is_symlink = S_ISLNK(r.mode);
+        e->nlink = r.nlink;
+        e->uid = r.uid;
+        e->gid = r.gid;
+        e->mtime = r.mtime;
+        e->ctime = r.ctime;
+        e->atime = 0;
+        e->mtime_nsec = r.mtime_nsec;
+        e->ctime_nsec = r.ctime_nsec;
+        e->atime_nsec = 0;
+        e->ino = 0;
+        e->blocks = r.blocks;
+        e->color = 0;
+
+        if (restat_all || (r.ctime != 0 && r.ctime >= h.written - CACHE_RACY))
+            pending[npending++] = i;
+    }
+    free(buf);
+
+    size_t kept = h.count;
+    if (npending > 0 && stat_batch(dirfd, entries, pending, npending, mask, ok) != npending)
+    {
+        /* Entries removed since the snapshot was taken */
+        for (size_t i = 0; i < npending; i++)
+            if (!ok[i]) entries[pending[i]].name = NULL;
+        kept = 0;
+        for (size_t i = 0; i < h.count; i++)
+            if (entries[i].name) entries[kept++] = entries[i];
+    }
+    free(pending);
+    free(ok);
+
+    for (size_t i = 0; color_enabled && i < kept; i++)
+    {
+        entries[i].color = color_for_ext(entries[i].name, entries[i].name_len);
+        color_classify(&entries[i], dirfd);
+    }
+
+    *out = entries;
+    *count = kept;
+    return 0;
+}
+
+/* Write a snapshot of the sorted `entries` of directory `dst`. It goes
+ * to a temporary file that is renamed into place, so concurrent readers
+ * see either the old snapshot or the new one, never a partial file. A
+ * directory changed within the last CACHE_RACY seconds is not cached:
+ * a further change in the same timestamp tick would go unnoticed. */
+void cache_store(const struct stat *dst, unsigned int flags, const FileEntry *entries, size_t count)
+{
+    time_t now = time(NULL);
+    if (dst->st_mtime >= now - CACHE_RACY || dst->st_ctime >= now - CACHE_RACY) return;
+
+    size_t names_len = 0;
+    for (size_t i = 0; i < count; i++)
+        names_len += entries[i].name_len + 1;
+    size_t size = sizeof(CacheHeader) + count * sizeof(CacheRecord) + names_len;
+    if (size > CACHE_FILE_MAX) return;
+
+    char path[PATH_MAX], tmp[PATH_MAX];
+    if (cache_path(path, sizeof(path), dst, flags) == -1) return;
+    if ((size_t)snprintf(tmp, sizeof(tmp), "%s/.tmp-XXXXXX", cache_dir) >= sizeof(tmp)) return;
+
+    unsigned char *buf = malloc(size);
+    if (!buf) return;
+    unsigned char *rec = buf + sizeof(CacheHeader);
+    unsigned char *names = rec + count * sizeof(CacheRecord);
+    for (size_t i = 0; i < count; i++)
+    {
+        const FileEntry *e = &entries[i];
+        CacheRecord r;
+        memset(&r, 0, sizeof(r));
+        r.size = e->size;
+        r.mtime = e->mtime;
+        r.ctime = e->ctime;
+        r.mtime_nsec = e->mtime_nsec;
+        r.ctime_nsec = e->ctime_nsec;
+        r.blocks = e->blocks;
+        r.nlink = e->nlink;
+        r.mode = e->mode;
+        r.uid = e->uid;
+        r.gid = e->gid;
+        r.name_len = (uint32_t)e->name_len;
+        memcpy(rec + i * sizeof(r), &r, sizeof(r));
+        memcpy(names, e->name, e->name_len + 1);
+        names += e->name_len + 1;
+    }
+
+    CacheHeader h;
+    memset(&h, 0, sizeof(h));
+    h.magic = CACHE_MAGIC;
+    h.version = CACHE_VERSION;
+    h.flags = flags;
+    h.mask = meta_mask_for(flags & CACHE_F_LONG);
+    h.dev = dst->st_dev;
+    h.ino = dst->st_ino;
+    h.mtime_sec = dst->st_mtim.tv_sec;
+    h.mtime_nsec = dst->st_mtim.tv_nsec;
+    h.ctime_sec = dst->st_ctim.tv_sec;
+    h.ctime_nsec = dst->st_ctim.tv_nsec;
+    h.written = now;
+    h.count = count;
+    h.names_len = names_len;
+    h.checksum = cache_checksum(buf + sizeof(h), size - sizeof(h));
+    memcpy(buf, &h, sizeof(h));
+
+    int fd = mkstemp(tmp);
+    if (fd == -1)
+    {
+        free(buf);
+        return;
+    }
+    size_t off = 0;
+    while (off < size)
+    {
+        ssize_t w = write(fd, buf + off, size - off);
+        if (w == -1 && errno == EINTR) continue;
+        if (w <= 0) break;
+        off += (size_t)w;
+    }
+    free(buf);
+    if (close(fd) == -1 || off != size || rename(tmp, path) == -1)
+    {
+        unlink(tmp);
+        return;
+    }
+    cache_gc();
+}
+
+typedef struct {
+    char *name;
+    off_t size;
+    time_t mtime;
+} CacheFile;
+
+static int cmp_cache_age(const void *a, const void *b)
+{
+    const CacheFile *fa = a, *fb = b;
+    return (fa->mtime > fb->mtime) - (fa->mtime < fb->mtime);
+}
+
+/* Keep the cache under CACHE_MAX_BYTES by deleting the oldest snapshots.
+ * Runs at most once per CACHE_GC_INTERVAL across all processes, gated by
+ * the mtime of a stamp file; unlink() is safe against concurrent readers
+ * since they hold the file open. Leftover temporaries are removed too. */
+void cache_gc(void)
+{
+    char stamp[PATH_MAX];
+    if ((size_t)snprintf(stamp, sizeof(stamp), "%s/.gc", cache_dir) >= sizeof(stamp)) return;
+    time_t now = time(NULL);
+    struct stat st;
+    if (stat(stamp, &st) == 0 && st.st_mtime > now - CACHE_GC_INTERVAL) return;
+    int sfd = open(stamp, O_WRONLY | O_CREAT | O_CLOEXEC, 0600);
+    if (sfd == -1) return;
+    futimens(sfd, NULL);
+    close(sfd);
+
+    int dfd = open(cache_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *d = dfd == -1 ? NULL : fdopendir(dfd);
+    if (!d)
+    {
+        if (dfd != -1) close(dfd);
+        return;
+    }
+
+    CacheFile *files = NULL;
+    size_t n = 0, cap = 0;
+    unsigned long long total = 0;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL)
+    {
+        int is_tmp = strncmp(de->d_name, ".tmp-", 5) == 0;
+        size_t len = strlen(de->d_name);
+        if (!is_tmp && (len < 4 || strcmp(de->d_name + len - 4, ".lsc") != 0)) continue;
+        if (fstatat(dfd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1) continue;
+        if (is_tmp)
+        {
+            if (st.st_mtime < now - CACHE_MAX_AGE) unlinkat(dfd, de->d_name, 0);
+            continue;
+        }
+        if (n == cap)
+        {
+            cap = cap ? cap * 2 : 256;
+            CacheFile *grown = realloc(files, cap * sizeof(CacheFile));
+            if (!grown) break;
+            files = grown;
+        }
+        files[n].name = strdup(de->d_name);
+        if (!files[n].name) break;
+        files[n].size = st.st_size;
+        files[n].mtime = st.st_mtime;
+        total += (unsigned long long)st.st_size;
+        n++;
+    }
+
+    if (total > CACHE_MAX_BYTES)
+    {
+        qsort(files, n, sizeof(CacheFile), cmp_cache_age);
+        /* Trim to three quarters so the next writes do not trigger again */
+        for (size_t i = 0; i < n && total > CACHE_MAX_BYTES / 4 * 3; i++)
+            if (unlinkat(dfd, files[i].name, 0) == 0)
+                total -= (unsigned long long)files[i].size;
+    }
+
+    for (size_t i = 0; i < n; i++)
+        free(files[i].name);
+    free(files);
+    closedir(d);
+}
+
+/* ---------- Recursive ls ---------- */
+void do_ls(const char *dir, int long_flag, int horizontal_flag, int recursive_flag)
+{
+    /* --du needs the serial walk: totals are finished bottom-up */
+    if (recursive_flag && jobs > 1 && !du_flag)
+        do_ls_parallel(dir, long_flag, horizontal_flag);
+    else
+        do_ls_walk(dir, long_flag, horizontal_flag, recursive_flag);
+}
+
+/* Append "/name" (or the root's name) to the display path */
+static void walk_path_push(Walk *w, size_t base, const char *name)
+{
+    size_t nlen = strlen(name), need = base + (base ? 1 : 0) + nlen + 1;
+    if (need > w->path_cap)
+    {
+        w->path_cap = need * 2;
+        w->path = realloc(w->path, w->path_cap);
+        if (!w->path)
+        {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (base) w->path[base++] = '/';
+    memcpy(w->path + base, name, nlen + 1);
+}
+
+static size_t walk_path_len(const Walk *w)
+{
+    return w->depth ? w->frames[w->depth - 1].path_len : 0;
+}
+
+/* List `name` under `parent_fd` and, if it has subdirectories to visit,
+ * push it as the new top of the stack. Its entries are released before
+ * this returns, so an ancestor only holds on to its subdirectory names. */
+void walk_enter(Walk *w, int parent_fd, const char *name,
+                int long_flag, int horizontal_flag, int recursive_flag)
+{
+    size_t base = walk_path_len(w);
+    walk_path_push(w, base, name);
+
+    DirReader dr;
+    uint64_t t0 = stats_clock();
+    if (dir_open(&dr, parent_fd, name) == -1)
+    {
+        out_flush(&out_stdout);
+        fprintf(stderr, "Cannot open directory: %s\n", w->path);
+        w->path[base] = '\0';
+        return;
+    }
+
+    DuTotal du;
+    if (du_flag) du_begin(&du, dr.fd);
+    else print_dir_header(&out_stdout, w->path);  // header for recursive display
+
+    NameList subdirs = { NULL, 0, 0 };
+    list_directory(&dr, &out_stdout, long_flag, horizontal_flag, recursive_flag ? &subdirs : NULL,
+                   du_flag ? &du : NULL);
+    stats_dir(w->path, t0);
+
+    if (subdirs.count == 0)
+    {
+        if (du_flag) du_finish(w->path, &du, w->depth ? &w->frames[w->depth - 1].du : NULL);
+        name_list_free(&subdirs);
+        dir_close(&dr);
+        w->path[base] = '\0';
+        return;
+    }
+
+    if (w->depth == w->cap)
+    {
+        w->cap = w->cap ? w->cap * 2 : 64;
+        w->frames = realloc(w->frames, w->cap * sizeof(WalkFrame));
+        if (!w->frames)
+        {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    WalkFrame *f = &w->frames[w->depth++];
+    memset(f, 0, sizeof(*f));
+    f->fd = dr.fd;
+    f->path_len = strlen(w->path);
+    f->subdirs = subdirs;
+    if (du_flag) f->du = du;
+    w->nopen++;
+    walk_evict(w);
+}
+
+/* How many ancestor descriptors a walk may keep: WALK_FDS_MAX, or a
+ * quarter of RLIMIT_NOFILE when that is lower */
+size_t walk_fd_limit(void)
+{
+    size_t max_fds = WALK_FDS_MAX;
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY &&
+        rl.rlim_cur / 4 < max_fds)
+        max_fds = rl.rlim_cur / 4;
+    return max_fds < 2 ? 2 : max_fds;
+}
+
+/* Close the descriptors of the oldest ancestors while more than max_fds
+ * are open. The top frame is never evicted: its children open through it. */
+void walk_evict(Walk *w)
+{
+    while (w->nopen > w->max_fds && w->lowest_open + 1 < w->depth)
+    {
+        WalkFrame *f = &w->frames[w->lowest_open++];
+        if (f->fd == -1) continue;
+        struct stat st;
+        if (fstat(f->fd, &st) == 0)
+        {
+            f->dev = st.st_dev;
+            f->ino = st.st_ino;
+        }
+        close(f->fd);
+        stats_count(SC_CLOSE, 1);
+        f->fd = -1;
+        w->nopen--;
+    }
+}
+
+/* Give the evicted frame k a descriptor again: through ".." of its child
+ * when that is still open, else through its display path. Either way the
+ * directory must be the one that was evicted. Returns -1 if it is gone. */
+int walk_reopen(Walk *w, size_t k, int child_fd)
+{
+    WalkFrame *f = &w->frames[k];
+    int fd = -1;
+    struct stat st;
+
+    if (child_fd != -1)
+        fd = openat(child_fd, "..", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1 && f->path_len < PATH_MAX)
+    {
+        w->path[f->path_len] = '\0';
+        fd = openat(AT_FDCWD, w->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+    stats_count(SC_OPENAT, 1);
+    if (fd != -1 && (fstat(fd, &st) == -1 || st.st_dev != f->dev || st.st_ino != f->ino))
+    {
+        close(fd);
+        fd = -1;
+    }
+    if (fd == -1) return -1;
+
+    f->fd = fd;
+    w->nopen++;
+    w->lowest_open = k;
+    return 0;
+}
+
+/* Finish the top frame. An evicted parent is reopened on the way up, so
+ * the new top can keep opening its remaining subdirectories. */
+void walk_pop(Walk *w)
+{
+    WalkFrame *top = &w->frames[w->depth - 1];
+
+    if (du_flag)
+    {
+        w->path[top->path_len] = '\0';
+        du_finish(w->path, &top->du, w->depth > 1 ? &w->frames[w->depth - 2].du : NULL);
+    }
+
+    if (w->depth > 1)
+    {
+        size_t k = w->depth - 2;
+        WalkFrame *parent = &w->frames[k];
+        if (parent->fd == -1 && walk_reopen(w, k, top->fd) == -1)
+        {
+            w->path[parent->path_len] = '\0';
+            out_flush(&out_stdout);
+            fprintf(stderr, "Cannot reopen directory: %s\n", w->path);
+            parent->next = parent->subdirs.count;
+        }
+    }
+
+    if (top->fd != -1)
+    {
+        close(top->fd);
+        stats_count(SC_CLOSE, 1);
+        w->nopen--;
+    }
+    name_list_free(&top->subdirs);
+    w->depth--;
+    if (w->lowest_open > w->depth) w->lowest_open = w->depth;
+    if (w->depth) w->path[w->frames[w->depth - 1].path_len] = '\0';
+}
+
+/* Serial listing of `dir` and, with -R, everything below it, depth-first
+ * on an explicit stack. Memory grows with the depth of the current path
+ * and the pending subdirectory names, never with the ancestors' entries,
+ * and at most max_fds ancestor descriptors stay open. */
+void do_ls_walk(const char *dir, int long_flag, int horizontal_flag, int recursive_flag)
+{
+    Walk w;
+    memset(&w, 0, sizeof(w));
+
+    w.max_fds = walk_fd_limit();
+    walk_enter(&w, AT_FDCWD, dir, long_flag, horizontal_flag, recursive_flag);
+
+    while (w.depth > 0)
+    {
+        WalkFrame *top = &w.frames[w.depth - 1];
+        if (top->next == top->subdirs.count)
+        {
+            walk_pop(&w);
+            continue;
+        }
+        const char *name = top->subdirs.names[top->next++];
+        if (out_format == FMT_TEXT && !du_flag) out_putc(&out_stdout, '\n');
+        walk_enter(&w, top->fd, name, long_flag, horizontal_flag, recursive_flag);
+    }
+
+    free(w.frames);
+    free(w.path);
+}
+
+
+/* ---------- Watch Mode ---------- */
+
+/* Slot holding `name`, or the empty slot where it belongs */
+static FileEntry **set_slot(EntrySet *s, const char *name, size_t len)
+{
+    size_t mask = s->cap - 1;
+    size_t i = ext_hash(name, len) & mask;
+    while (s->slots[i] && strcmp(s->slots[i]->name, name) != 0)
+        i = (i + 1) & mask;
+    return &s->slots[i];
+}
+
+static void set_put(EntrySet *s, FileEntry *e)
+{
+    if ((s->count + 1) * 4 > s->cap * 3)
+    {
+        FileEntry **old = s->slots;
+        size_t old_cap = s->cap;
+        s->cap = old_cap ? old_cap * 2 : 64;
+        s->slots = calloc(s->cap, sizeof(FileEntry *));
+        if (!s->slots)
+        {
+            perror("calloc");
+            exit(EXIT_FAILURE);
+        }
+        for (size_t i = 0; i < old_cap; i++)
+            if (old[i]) *set_slot(s, old[i]->name, old[i]->name_len) = old[i];
+        free(old);
+    }
+    *set_slot(s, e->name, e->name_len) = e;
+    s->count++;
+}
+
+/* Empty `slot` and shift the rest of its probe run back over the hole,
+ * so lookups never have to step over tombstones */
+static void set_remove(EntrySet *s, FileEntry **slot)
+{
+    size_t mask = s->cap - 1;
+    size_t i = (size_t)(slot - s->slots), j = i;
+    s->slots[i] = NULL;
+    s->count--;
+    for (;;)
+    {
+        j = (j + 1) & mask;
+        FileEntry *e = s->slots[j];
+        if (!e) return;
+        size_t home = ext_hash(e->name, e->name_len) & mask;
+        /* e may fill the hole unless its home lies cyclically in (i, j] */
+        if (j > i ? (home <= i || home > j) : (home <= i && home > j))
+        {
+            s->slots[i] = e;
+            s->slots[j] = NULL;
+            i = j;
+        }
+    }
+}
+
+static void set_free(EntrySet *s)
+{
+    for (size_t i = 0; i < s->cap; i++)
+    {
+        if (!s->slots[i]) continue;
+        free(s->slots[i]->name);
+        free(s->slots[i]);
+    }
+    free(s->slots);
+    memset(s, 0, sizeof(*s));
+}
+
+/* The set's entries in name order, in this thread's entry arena */
+static FileEntry *set_sorted(const EntrySet *s)
+{
+    FileEntry *entries = arena_alloc(&entry_arena, (s->count ? s->count : 1) * sizeof(FileEntry));
+    size_t n = 0;
+    for (size_t i = 0; i < s->cap; i++)
+        if (s->slots[i]) entries[n++] = *s->slots[i];
+    if (n > 0) sort_entries_by_name(entries, n);
+    return entries;
+}
+
+static FileEntry *entry_dup(const FileEntry *src)
+{
+    FileEntry *e = malloc(sizeof(FileEntry));
+    char *name = strdup(src->name);
+    if (!e || !name)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    *e = *src;
+    e->name = name;
+    return e;
+}
+
+/* Whether the listing shows a difference between two states of an
+ * entry, in what it prints or where -S/-t put it */
+static int entry_differs(const Watcher *w, const FileEntry *a, const FileEntry *b)
+{
+    if (a->mode != b->mode) return 1;
+    if (sort_mode == SORT_SIZE && a->size != b->size) return 1;
+    if (sort_mode == SORT_TIME || w->long_flag)
+    {
+        int c = time_field == TIME_CTIME, u = time_field == TIME_ATIME;
+        if ((c ? a->ctime != b->ctime : u ? a->atime != b->atime : a->mtime != b->mtime)) return 1;
+        if (sort_mode == SORT_TIME &&
+            (c ? a->ctime_nsec != b->ctime_nsec : u ? a->atime_nsec != b->atime_nsec :
+             a->mtime_nsec != b->mtime_nsec))
+            return 1;
+    }
+    if (!w->long_flag) return 0;
+    return a->size != b->size || a->nlink != b->nlink || a->uid != b->uid || a->gid != b->gid;
+}
+
+/* Writes change the size, mtime and ctime but raise only IN_MODIFY, so
+ * it is wanted whenever one of those is shown or sorted on. Reads are
+ * not watched: -u does not follow atime updates. */
+static uint32_t watch_events(const Watcher *w)
+{
+    int modify = w->long_flag || sort_mode == SORT_SIZE ||
+                 (sort_mode == SORT_TIME && time_field != TIME_ATIME);
+    return WATCH_EVENTS | (modify ? IN_MODIFY : 0);
+}
+
+static void watch_print_row(const Watcher *w, FileEntry *e)
+{
+    if (w->long_flag)
+    {
+        print_long_entry(&out_stdout, e);
+    }
+    else
+    {
+        print_colored_padded(&out_stdout, e, 0);
+        out_putc(&out_stdout, '\n');
+    }
+}
+
+/* One change record: '+', '-' or '~', then the entry's row under its full path */
+static void watch_record(const Watcher *w, const WatchDir *d, char op, const FileEntry *e)
+{
+    FileEntry row = *e;
+    row.name = join_path(d->path, e->name);
+    if (!row.name)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    row.name_len = strlen(row.name);
+    row.name_width = name_width(row.name, row.name_len);
+    out_putc(&out_stdout, op);
+    out_putc(&out_stdout, ' ');
+    watch_print_row(w, &row);
+    free(row.name);
+}
+
+static void watch_goto_row(int row)
+{
+    char seq[32];
+    snprintf(seq, sizeof(seq), "\033[%d;1H", row);
+    out_str(&out_stdout, seq);
+}
+
+/* Report a change to `e` in `d`: as a record when stdout is not a tty,
+ * by patching its row when the listing allows it, else by scheduling a
+ * redraw. '+' is reported after the entry joins the set, '-' before it
+ * leaves. */
+static void watch_change(Watcher *w, WatchDir *d, char op, FileEntry *e)
+{
+    if (!w->tty)
+    {
+        watch_record(w, d, op, e);
+        return;
+    }
+    if (!w->row_mode || w->dirty ||
+        (op == '+' && (d->set.count == 1 || (int)d->set.count + 2 >= w->screen_rows)) ||
+        (op == '-' && d->set.count == 1))
+    {
+        w->dirty = 1;
+        return;
+    }
+
+    /* The header is row 1; the listing fits the screen, so this is cheap */
+    int rank = 0;
+    for (size_t i = 0; i < d->set.cap; i++)
+        if (d->set.slots[i] && strcmp(d->set.slots[i]->name, e->name) < 0) rank++;
+    watch_goto_row(rank + 2);
+    if (op == '-')
+    {
+        out_str(&out_stdout, "\033[M");
+        return;
+    }
+    out_str(&out_stdout, op == '+' ? "\033[L" : "\033[2K");
+    watch_print_row(w, e);
+}
+
+/* Stat `name` in `d` into *e. Returns -1 if it is gone. */
+static int watch_stat(const Watcher *w, const WatchDir *d, const char *name, FileEntry *e)
+{
+    struct stat st;
+    if (meta_stat(d->fd, name, meta_mask_for(w->long_flag), &st) == -1) return -1;
+    memset(e, 0, sizeof(*e));
+    e->name = (char *)name;
+    e->name_len = strlen(name);
+    e->name_width = name_width(name, e->name_len);
+    entry_fill_stat(e, &st);
+    if (color_enabled)
+    {
+        e->color = color_for_ext(name, e->name_len);
+        color_classify(e, d->fd);
+    }
+    return 0;
+}
+
+/* Stop watching dirs[di]. `rm` also removes the kernel watch, which is
+ * already gone when the directory itself was deleted. */
+static void watch_drop(Watcher *w, size_t di, int rm)
+{
+    WatchDir *d = &w->dirs[di];
+    if (d->wd == -1) return;
+    if (rm) inotify_rm_watch(w->ifd, d->wd);
+    w->by_wd[d->wd] = 0;
+    close(d->fd);
+    set_free(&d->set);
+    free(d->path);
+    d->path = NULL;
+    d->wd = -1;
+    w->nlive--;
+    w->dirty = 1;
+}
+
+/* Open `name` under `parent_fd`, subscribe to it and read its entries.
+ * The watch goes on before the read, so nothing created in between is
+ * missed. With `announce`, the entries are reported as new. */
+int watch_add(Watcher *w, int parent_fd, const char *name, const char *path, int root, int announce)
+{
+    DirReader dr;
+    if (dir_open(&dr, parent_fd, name) == -1)
+    {
+        out_flush(&out_stdout);
+        fprintf(stderr, "Cannot open directory: %s\n", path);
+        return -1;
+    }
+
+    /* Through the descriptor: display paths are not bounded by PATH_MAX */
+    char proc[64];
+    snprintf(proc, sizeof(proc), "/proc/self/fd/%d", dr.fd);
+    int wd = inotify_add_watch(w->ifd, proc, watch_events(w));
+    if (wd == -1)
+    {
+        out_flush(&out_stdout);
+        fprintf(stderr, "Cannot watch directory: %s: %s\n", path, strerror(errno));
+        dir_close(&dr);
+        return -1;
+    }
+    /* The same directory reached twice, e.g. through a bind mount */
+    if ((size_t)wd < w->nwd && w->by_wd[wd])
+    {
+        dir_close(&dr);
+        return -1;
+    }
+
+    if ((size_t)wd >= w->nwd)
+    {
+        size_t n = w->nwd ? w->nwd : 64;
+        while (n <= (size_t)wd) n *= 2;
+        w->by_wd = realloc(w->by_wd, n * sizeof(size_t));
+        if (!w->by_wd)
+        {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        memset(w->by_wd + w->nwd, 0, (n - w->nwd) * sizeof(size_t));
+        w->nwd = n;
+    }
+    if (w->ndirs == w->cap)
+    {
+        w->cap = w->cap ? w->cap * 2 : 16;
+        w->dirs = realloc(w->dirs, w->cap * sizeof(WatchDir));
+        if (!w->dirs)
+        {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    size_t di = w->ndirs++;
+    WatchDir *d = &w->dirs[di];
+    memset(d, 0, sizeof(*d));
+    d->wd = wd;
+    d->fd = dr.fd;
+    d->root = root;
+    d->path = strdup(path);
+    if (!d->path)
+    {
+        perror("strdup");
+        exit(EXIT_FAILURE);
+    }
+    w->by_wd[wd] = di + 1;
+    w->nlive++;
+
+    ArenaMark name_mark = arena_mark(&name_arena);
+    ArenaMark entry_mark = arena_mark(&entry_arena);
+    FileEntry *entries;
+    size_t count = read_entries(&dr, w->long_flag, &entries);
+    for (size_t i = 0; i < count; i++)
+    {
+        FileEntry *e = entry_dup(&entries[i]);
+        set_put(&d->set, e);
+        if (announce) watch_change(w, d, '+', e);
+    }
+    if (d->set.cap == 0)
+    {
+        d->set.cap = 64;
+        d->set.slots = calloc(d->set.cap, sizeof(FileEntry *));
+        if (!d->set.slots)
+        {
+            perror("calloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    arena_release(&entry_arena, entry_mark);
+    arena_release(&name_arena, name_mark);
+    return 0;
+}
+
+/* Watch `name` and, with -R, every directory below it. Each new
+ * directory is appended to w->dirs, so walking the array from `first`
+ * visits the whole subtree without recursion. */
+void watch_tree(Watcher *w, int parent_fd, const char *name, const char *path, int root, int announce)
+{
+    size_t first = w->ndirs;
+    if (watch_add(w, parent_fd, name, path, root, announce) == -1) return;
+    w->dirs[first].is_root = (parent_fd == AT_FDCWD);
+    if (!w->recursive_flag) return;
+
+    for (size_t i = first; i < w->ndirs; i++)
+    {
+        /* w->dirs moves as it grows; the slot array it points at does not */
+        FileEntry **slots = w->dirs[i].set.slots;
+        size_t cap = w->dirs[i].set.cap;
+        for (size_t k = 0; k < cap; k++)
+        {
+            if (!slots[k] || !is_descendable(slots[k])) continue;
+            char *sub = join_path(w->dirs[i].path, slots[k]->name);
+            if (!sub)
+            {
+                perror("malloc");
+                exit(EXIT_FAILURE);
+            }
+            watch_add(w, w->dirs[i].fd, slots[k]->name, sub, root, announce);
+            free(sub);
+        }
+    }
+}
+
+/* Stop watching `path` and everything below it, reporting what was left
+ * in those directories as removed */
+static void watch_forget(Watcher *w, const char *path)
+{
+    /* `path` may be one of the paths about to be freed */
+    char *prefix = strdup(path);
+    if (!prefix)
+    {
+        perror("strdup");
+        exit(EXIT_FAILURE);
+    }
+    size_t plen = strlen(prefix);
+    for (size_t i = 0; i < w->ndirs; i++)
+    {
+        WatchDir *d = &w->dirs[i];
+        if (d->wd == -1 || strncmp(d->path, prefix, plen) != 0 ||
+            (d->path[plen] != '\0' && d->path[plen] != '/'))
+            continue;
+        for (size_t k = 0; k < d->set.cap; k++)
+            if (d->set.slots[k]) watch_change(w, d, '-', d->set.slots[k]);
+        watch_drop(w, i, 1);
+    }
+    free(prefix);
+}
+
+/* Bring the set's idea of `name` in dirs[di] up to date with one stat */
+void watch_refresh(Watcher *w, size_t di, const char *name)
+{
+    WatchDir *d = &w->dirs[di];
+    FileEntry fresh;
+    int exists = (watch_stat(w, d, name, &fresh) == 0);
+    FileEntry **slot = set_slot(&d->set, name, strlen(name));
+
+    if (exists && *slot)
+    {
+        if (!entry_differs(w, *slot, &fresh)) return;
+        fresh.name = (*slot)->name;
+        **slot = fresh;
+        watch_change(w, d, '~', *slot);
+    }
+    else if (exists)
+    {
+        FileEntry *e = entry_dup(&fresh);
+        set_put(&d->set, e);
+        watch_change(w, d, '+', e);
+        if (w->recursive_flag && is_descendable(e))
+        {
+            char *sub = join_path(d->path, name);
+            if (!sub)
+            {
+                perror("malloc");
+                exit(EXIT_FAILURE);
+            }
+            watch_tree(w, d->fd, name, sub, d->root, 1);
+            free(sub);
+        }
+    }
+    else if (*slot)
+    {
+        FileEntry *e = *slot;
+        watch_change(w, d, '-', e);
+        if (w->recursive_flag && S_ISDIR(e->mode))
+        {
+            char *sub = join_path(d->path, name);
+            if (!sub)
+            {
+                perror("malloc");
+                exit(EXIT_FAILURE);
+            }
+            watch_forget(w, sub);
+            free(sub);
+        }
+        set_remove(&d->set, slot);
+        free(e->name);
+        free(e);
+    }
+}
+
+/* The event queue overflowed: compare every watched directory with a
+ * fresh read and refresh whatever differs */
+void watch_resync(Watcher *w)
+{
+    for (size_t i = 0; i < w->ndirs; i++)
+    {
+        if (w->dirs[i].wd == -1) continue;
+        DirReader dr;
+        if (dir_open(&dr, w->dirs[i].fd, ".") == -1) continue;
+
+        ArenaMark name_mark = arena_mark(&name_arena);
+        ArenaMark entry_mark = arena_mark(&entry_arena);
+        FileEntry *entries;
+        size_t count = read_entries(&dr, w->long_flag, &entries);
+        dir_close(&dr);
+        if (count > 0) sort_entries_by_name(entries, count);
+
+        /* Names the set still holds but the directory no longer does */
+        EntrySet *s = &w->dirs[i].set;
+        char **gone = arena_alloc(&name_arena, (s->count ? s->count : 1) * sizeof(char *));
+        size_t ngone = 0;
+        for (size_t k = 0; k < s->cap; k++)
+        {
+            if (!s->slots[k]) continue;
+            FileEntry key = { .name = s->slots[k]->name };
+            if (!bsearch(&key, entries, count, sizeof(FileEntry), cmp_entry))
+                gone[ngone++] = arena_strdup(&name_arena, key.name);
+        }
+        for (size_t k = 0; k < ngone; k++)
+            watch_refresh(w, i, gone[k]);
+        for (size_t k = 0; k < count; k++)
+            watch_refresh(w, i, entries[k].name);
+
+        arena_release(&entry_arena, entry_mark);
+        arena_release(&name_arena, name_mark);
+    }
+}
+
+/* -R listing order: by command-line directory, then depth-first, which
+ * is path order with '/' sorting before every other byte */
+static int cmp_watch_dir(const void *a, const void *b)
+{
+    const WatchDir *x = *(WatchDir * const *)a;
+    const WatchDir *y = *(WatchDir * const *)b;
+    if (x->root != y->root) return x->root - y->root;
+    const unsigned char *p = (const unsigned char *)x->path;
+    const unsigned char *q = (const unsigned char *)y->path;
+    while (*p && *p == *q) p++, q++;
+    int cp = *p == '/' ? 1 : *p ? *p + 1 : 0;
+    int cq = *q == '/' ? 1 : *q ? *q + 1 : 0;
+    return cp - cq;
+}
+
+/* Whether watched directory `d` lies below `top`; paths come from join_path */
+static int watch_dir_below(const WatchDir *d, const WatchDir *top)
+{
+    size_t len = strlen(top->path);
+    return d->root == top->root && strncmp(d->path, top->path, len) == 0 && d->path[len] == '/';
+}
+
+/* Reorder the path-sorted `order` and its listings `lists` into the -R
+ * order of a non-name sort: each directory's subdirectories follow in
+ * the order its own listing shows them. Path order keeps every subtree
+ * contiguous and a directory's children in name order, so each child
+ * is found by binary search. Preorder on an explicit stack. */
+static void watch_listing_order(WatchDir **order, FileEntry **lists, size_t n)
+{
+    size_t *end = arena_alloc(&entry_arena, n * sizeof(size_t));
+    size_t *stack = arena_alloc(&entry_arena, n * sizeof(size_t));
+    size_t *kids = arena_alloc(&entry_arena, n * sizeof(size_t));
+    size_t *out = arena_alloc(&entry_arena, n * sizeof(size_t));
+    unsigned char *placed = arena_alloc(&entry_arena, n);
+    memset(placed, 0, n);
+
+    /* end[i]: one past the last directory below order[i] */
+    size_t depth = 0;
+    for (size_t i = 0; i <= n; i++)
+    {
+        while (depth > 0 && (i == n || !watch_dir_below(order[i], order[stack[depth - 1]])))
+            end[stack[--depth]] = i;
+        if (i < n) stack[depth++] = i;
+    }
+
+    size_t nout = 0;
+    for (size_t top = 0; top < n; top = end[top])
+    {
+        stack[depth++] = top;
+        while (depth > 0)
+        {
+            size_t i = stack[--depth];
+            out[nout++] = i;
+
+            size_t nkids = 0;
+            for (size_t j = i + 1; j < end[i]; j = end[j])
+                kids[nkids++] = j;
+            /* Push in reverse listing order so they pop in listing order */
+            size_t first = depth;
+            for (size_t k = 0; k < order[i]->set.count; k++)
+            {
+                const FileEntry *e = &lists[i][k];
+                if (!is_descendable(e)) continue;
+                size_t lo = 0, hi = nkids;
+                while (lo < hi)
+                {
+                    size_t mid = lo + (hi - lo) / 2;
+                    int c = strcmp(strrchr(order[kids[mid]]->path, '/') + 1, e->name);
+                    if (c == 0) lo = hi = mid;
+                    else if (c < 0) lo = mid + 1;
+                    else hi = mid;
+                }
+                if (lo < nkids && !placed[kids[lo]] &&
+                    strcmp(strrchr(order[kids[lo]]->path, '/') + 1, e->name) == 0)
+                {
+                    placed[kids[lo]] = 1;
+                    stack[depth++] = kids[lo];
+                }
+            }
+            /* A watched directory its parent's set no longer shows goes last */
+            for (size_t k = 0; k < nkids; k++)
+                if (!placed[kids[k]])
+                {
+                    placed[kids[k]] = 1;
+                    stack[depth++] = kids[k];
+                }
+            for (size_t a = first, b = depth; a + 1 < b; a++, b--)
+            {
+                size_t t = stack[a];
+                stack[a] = stack[b - 1];
+                stack[b - 1] = t;
+            }
+        }
+    }
+
+    WatchDir **dirs = arena_alloc(&entry_arena, n * sizeof(WatchDir *));
+    FileEntry **sorted = arena_alloc(&entry_arena, n * sizeof(FileEntry *));
+    for (size_t k = 0; k < n; k++)
+    {
+        dirs[k] = order[out[k]];
+        sorted[k] = lists[out[k]];
+    }
+    memcpy(order, dirs, n * sizeof(WatchDir *));
+    memcpy(lists, sorted, n * sizeof(FileEntry *));
+}
+
+/* Print every watched directory from its set, as a normal listing would.
+ * On a tty the screen is cleared first and row patching is re-armed
+ * when the listing allows it. */
+void watch_redraw(Watcher *w)
+{
+    ArenaMark name_mark = arena_mark(&name_arena);
+    ArenaMark entry_mark = arena_mark(&entry_arena);
+
+    WatchDir **order = arena_alloc(&entry_arena, (w->ndirs ? w->ndirs : 1) * sizeof(WatchDir *));
+    size_t n = 0;
+    for (size_t i = 0; i < w->ndirs; i++)
+        if (w->dirs[i].wd != -1) order[n++] = &w->dirs[i];
+    qsort(order, n, sizeof(WatchDir *), cmp_watch_dir);
+
+    FileEntry **lists = arena_alloc(&entry_arena, (n ? n : 1) * sizeof(FileEntry *));
+    for (size_t k = 0; k < n; k++)
+    {
+        lists[k] = set_sorted(&order[k]->set);
+        order_entries(lists[k], order[k]->set.count);
+    }
+    if (w->recursive_flag && n > 1 && (sort_mode != SORT_NAME || reverse_flag))
+        watch_listing_order(order, lists, n);
+
+    if (w->tty)
+    {
+        struct winsize ws;
+        w->screen_rows = (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0) ? ws.ws_row : 0;
+        out_str(&out_stdout, "\033[H\033[2J");
+    }
+    for (size_t k = 0; k < n; k++)
+    {
+        if (k > 0) out_putc(&out_stdout, '\n');
+        out_str(&out_stdout, order[k]->path);
+        out_str(&out_stdout, ":\n");
+        render_sorted(&out_stdout, lists[k], order[k]->set.count, w->long_flag, w->horizontal_flag);
+    }
+
+    /* Rows are patched at their name rank, so only a plain name order
+     * qualifies; -S/-t/-X/-r move entries on updates and need a redraw. */
+    w->row_mode = w->tty && n == 1 && !w->recursive_flag &&
+                  sort_mode == SORT_NAME && !reverse_flag &&
+                  (w->long_flag || (one_per_line && !w->horizontal_flag)) &&
+                  (int)order[0]->set.count + 2 < w->screen_rows;
+    w->dirty = 0;
+
+    arena_release(&entry_arena, entry_mark);
+    arena_release(&name_arena, name_mark);
+}
+
+void watch_event(Watcher *w, const struct inotify_event *ev)
+{
+    if (ev->mask & IN_Q_OVERFLOW)
+    {
+        watch_resync(w);
+        return;
+    }
+    if (ev->wd < 0 || (size_t)ev->wd >= w->nwd || !w->by_wd[ev->wd]) return;
+    size_t di = w->by_wd[ev->wd] - 1;
+
+    if (ev->mask & (IN_DELETE_SELF | IN_IGNORED))
+    {
+        watch_drop(w, di, !(ev->mask & IN_IGNORED));
+        return;
+    }
+    if (ev->len == 0 || (ev->name[0] == '.' && !show_all)) return;
+    watch_refresh(w, di, ev->name);
+}
+
+static void watch_on_winch(int sig)
+{
+    (void)sig;
+    watch_resized = 1;
+}
+
+/* --watch: list the directories once, then keep each one's entries in
+ * memory and apply inotify events to them. Every event costs one stat
+ * of the name it is about; the directories are never re-read unless the
+ * event queue overflows. Runs until interrupted or nothing is left. */
+void watch_run(const char **dirs, int ndirs, int long_flag, int horizontal_flag, int recursive_flag)
+{
+    static char evbuf[WATCH_EVBUF] __attribute__((aligned(__alignof__(struct inotify_event))));
+    Watcher w;
+    memset(&w, 0, sizeof(w));
+    w.long_flag = long_flag;
+    w.horizontal_flag = horizontal_flag;
+    w.recursive_flag = recursive_flag;
+    w.tty = isatty(STDOUT_FILENO);
+    w.ifd = inotify_init1(IN_CLOEXEC);
+    if (w.ifd == -1)
+    {
+        perror("inotify_init1");
+        exit(EXIT_FAILURE);
+    }
+
+    /* No SA_RESTART: a resize has to wake the poll below */
+    if (w.tty)
+    {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = watch_on_winch;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGWINCH, &sa, NULL);
+    }
+
+    for (int i = 0; i < ndirs; i++)
+        watch_tree(&w, AT_FDCWD, dirs[i], dirs[i], i, 0);
+    watch_redraw(&w);
+    out_flush(&out_stdout);
+
+    for (;;)
+    {
+        if (w.nlive == 0) break;
+        if (watch_resized)
+        {
+            watch_resized = 0;
+            __atomic_store_n(&term_width_cached, 0, __ATOMIC_RELAXED);
+            watch_redraw(&w);
+            out_flush(&out_stdout);
+        }
+
+        /* The open descriptor keeps a removed directory's inode, and so its
+         * watch, alive without IN_DELETE_SELF. Subdirectories are caught
+         * by their parent's events; the roots have to be checked. */
+        struct pollfd pfd = { .fd = w.ifd, .events = POLLIN };
+        int ready = poll(&pfd, 1, WATCH_IDLE_MS);
+        if (ready == -1 && errno == EINTR) continue;
+        if (ready == 0)
+        {
+            struct stat st;
+            for (size_t i = 0; i < w.ndirs; i++)
+                if (w.dirs[i].wd != -1 && w.dirs[i].is_root &&
+                    fstat(w.dirs[i].fd, &st) == 0 && st.st_nlink == 0)
+                    watch_forget(&w, w.dirs[i].path);
+            if (w.tty && w.dirty) watch_redraw(&w);
+            out_flush(&out_stdout);
+            continue;
+        }
+
+        ssize_t n = read(w.ifd, evbuf, sizeof(evbuf));
+        if (n == -1)
+        {
+            if (errno == EINTR) continue;
+            perror("read inotify");
+            break;
+        }
+
+        /* One stat per event; repeats within a batch find nothing new */
+        for (char *p = evbuf; p < evbuf + n; )
+        {
+            const struct inotify_event *ev = (const struct inotify_event *)p;
+            watch_event(&w, ev);
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+
+        if (w.tty && w.dirty)
+        {
+            watch_redraw(&w);
+        }
+        else if (w.row_mode)
+        {
+            for (size_t i = 0; i < w.ndirs; i++)
+                if (w.dirs[i].wd != -1) watch_goto_row((int)w.dirs[i].set.count + 2);
+        }
+        out_flush(&out_stdout);
+    }
+
+    for (size_t i = 0; i < w.ndirs; i++)
+        watch_drop(&w, i, 1);
+    free(w.dirs);
+    free(w.by_wd);
+    close(w.ifd);
+}
+/* ---------- Disk Usage ---------- */
+
+/* Whether the file (dev, ino) was counted already; records it if not */
+static int du_seen_before(uint64_t dev, uint64_t ino)
+{
+    if ((du_seen_count + 1) * 2 > du_seen_cap)
+    {
+        InodeKey *old = du_seen;
+        size_t old_cap = du_seen_cap;
+        du_seen_cap = old_cap ? old_cap * 2 : 1024;
+        du_seen = calloc(du_seen_cap, sizeof(InodeKey));
+        if (!du_seen)
+        {
+            perror("calloc");
+            exit(EXIT_FAILURE);
+        }
+        du_seen_count = 0;
+        for (size_t i = 0; i < old_cap; i++)
+            if (old[i].ino) du_seen_before(old[i].dev, old[i].ino);
+        free(old);
+    }
+
+    size_t mask = du_seen_cap - 1;
+    uint64_t h = (ino ^ (dev << 32) ^ (dev >> 32)) * 0x9e3779b97f4a7c15ull;
+    size_t i = (size_t)(h ^ (h >> 32)) & mask;
+    while (du_seen[i].ino)
+    {
+        if (du_seen[i].ino == ino && du_seen[i].dev == dev) return 1;
+        i = (i + 1) & mask;
+    }
+    du_seen[i].dev = dev;
+    du_seen[i].ino = ino;
+    du_seen_count++;
+    return 0;
+}
+
+/* Start a directory's total with the directory itself */
+void du_begin(DuTotal *t, int fd)
+{
+    struct stat st;
+    memset(t, 0, sizeof(*t));
+    if (fstat(fd, &st) == -1) return;
+    t->blocks = (uint64_t)st.st_blocks;
+    t->bytes = (uint64_t)st.st_size;
+    t->dev = st.st_dev;
+}
+
+/* Add a directory's entries. Subdirectories are left out: each brings
+ * its own total, itself included, when it is finished. A file with
+ * several links is counted the first time one of them is seen. */
+void du_add_entries(DuTotal *t, const FileEntry *entries, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        const FileEntry *e = &entries[i];
+        if (S_ISDIR(e->mode)) continue;
+        if (e->nlink > 1 && du_seen_before((uint64_t)t->dev, (uint64_t)e->ino)) continue;
+        t->blocks += (uint64_t)e->blocks;
+        t->bytes += (uint64_t)e->size;
+    }
+}
+
+/* Print a finished directory as "KiB<TAB>bytes<TAB>path", KiB rounded
+ * up as du does, and hand its total to the parent */
+void du_finish(const char *path, const DuTotal *t, DuTotal *parent)
+{
+    out_num(&out_stdout, (long long)((t->blocks + 1) / 2), 0);
+    out_putc(&out_stdout, '\t');
+    out_num(&out_stdout, (long long)t->bytes, 0);
+    out_putc(&out_stdout, '\t');
+    out_str(&out_stdout, path);
+    out_putc(&out_stdout, '\n');
+    if (parent)
+    {
+        parent->blocks += t->blocks;
+        parent->bytes += t->bytes;
+    }
+}
+
+/* ---------- Parallel -R ---------- */
+void deque_push(TaskDeque *dq, DirTask *t)
+{
+    pthread_mutex_lock(&dq->lock);
+    if (dq->head == dq->tail) dq->head = dq->tail = 0;
+    if (dq->tail == dq->cap)
+    {
+        dq->cap = dq->cap ? dq->cap * 2 : 64;
+        dq->items = realloc(dq->items, dq->cap * sizeof(DirTask *));
+        if (!dq->items)
+        {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    dq->items[dq->tail++] = t;
+    pthread_mutex_unlock(&dq->lock);
+}
+
+/* Owner side: newest task first, so each worker walks depth-first */
+DirTask *deque_pop(TaskDeque *dq)
+{
+    DirTask *t = NULL;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->tail > dq->head) t = dq->items[--dq->tail];
+    pthread_mutex_unlock(&dq->lock);
+    return t;
+}
+
+/* Thief side: oldest task, which tends to be the biggest subtree */
+DirTask *deque_steal(TaskDeque *dq)
+{
+    DirTask *t = NULL;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->tail > dq->head) t = dq->items[dq->head++];
+    pthread_mutex_unlock(&dq->lock);
+    return t;
+}
+
+/* Counters go up before the push so `queued` never underflows when a
+ * thief grabs the task immediately */
+void pool_submit(TaskPool *pool, int self, DirTask *t)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->queued++;
+    pool->outstanding++;
+    pthread_mutex_unlock(&pool->lock);
+    deque_push(&pool->deques[self], t);
+    pthread_cond_signal(&pool->work_cv);
+}
+
+static void handle_unlink(TaskPool *pool, DirHandle *h)
+{
+    if (h->prev) h->prev->next = h->next;
+    else pool->oldest = h->next;
+    if (h->next) h->next->prev = h->prev;
+    else pool->newest = h->prev;
+    h->prev = h->next = NULL;
+    pool->nopen--;
+}
+
+static void handle_link(TaskPool *pool, DirHandle *h)
+{
+    h->prev = pool->newest;
+    h->next = NULL;
+    if (pool->newest) pool->newest->next = h;
+    else pool->oldest = h;
+    pool->newest = h;
+    pool->nopen++;
+}
+
+/* Close the oldest idle handles while more than `limit` are open, as
+ * walk_evict does for the serial walk. Caller holds fd_lock. */
+static void handle_evict(TaskPool *pool, size_t limit)
+{
+    DirHandle *h = pool->oldest;
+    while (pool->nopen > limit && h)
+    {
+        DirHandle *next = h->next;
+        if (!h->busy)
+        {
+            struct stat st;
+            if (fstat(h->fd, &st) == 0)
+            {
+                h->dev = st.st_dev;
+                h->ino = st.st_ino;
+            }
+            close(h->fd);
+            stats_count(SC_CLOSE, 1);
+            h->fd = -1;
+            handle_unlink(pool, h);
+        }
+        h = next;
+    }
+}
+
+/* Start sharing a listed directory's descriptor with its `refs` children */
+static DirHandle *handle_new(TaskPool *pool, int fd, const char *path, int refs)
+{
+    DirHandle *h = calloc(1, sizeof(DirHandle));
+    if (!h)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    h->fd = fd;
+    h->refs = refs;
+    h->path = path;
+    pthread_mutex_lock(&pool->fd_lock);
+    handle_link(pool, h);
+    handle_evict(pool, pool->max_fds);
+    pthread_mutex_unlock(&pool->fd_lock);
+    return h;
+}
+
+/* Pin `h` and return its descriptor, reopening an evicted one by path
+ * like walk_reopen. Returns -1 if the directory is gone or replaced. */
+static int handle_acquire(TaskPool *pool, DirHandle *h)
+{
+    pthread_mutex_lock(&pool->fd_lock);
+    if (h->fd == -1)
+    {
+        handle_evict(pool, pool->max_fds - 1);
+        struct stat st;
+        int fd = strlen(h->path) < PATH_MAX
+                 ? openat(AT_FDCWD, h->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC) : -1;
+        stats_count(SC_OPENAT, 1);
+        if (fd != -1 && (fstat(fd, &st) == -1 || st.st_dev != h->dev || st.st_ino != h->ino))
+        {
+            close(fd);
+            fd = -1;
+            errno = ENOENT;
+        }
+        if (fd != -1)
+        {
+            h->fd = fd;
+            handle_link(pool, h);
+        }
+    }
+    if (h->fd != -1) h->busy++;
+    int fd = h->fd;
+    pthread_mutex_unlock(&pool->fd_lock);
+    return fd;
+}
+
+/* Drop one child's reference once it has opened; the last one closes */
+static void handle_release(TaskPool *pool, DirHandle *h, int pinned)
+{
+    pthread_mutex_lock(&pool->fd_lock);
+    if (pinned) h->busy--;
+    if (--h->refs == 0)
+    {
+        if (h->fd != -1)
+        {
+            close(h->fd);
+            stats_count(SC_CLOSE, 1);
+            handle_unlink(pool, h);
+        }
+        free(h);
+    }
+    pthread_mutex_unlock(&pool->fd_lock);
+}
+
+void run_task(TaskPool *pool, int self, DirTask *t)
+{
+    DirReader dr;
+    uint64_t t0 = stats_clock();
+    int parent_fd = t->parent ? handle_acquire(pool, t->parent) : AT_FDCWD;
+    int rc = parent_fd == -1 ? -1 : dir_open(&dr, parent_fd, t->name);
+    /* Out of descriptors: free the idle ones, then the display path
+     * still names the directory */
+    if (rc == -1 && (errno == EMFILE || errno == ENFILE) && strlen(t->path) < PATH_MAX)
+    {
+        pthread_mutex_lock(&pool->fd_lock);
+        handle_evict(pool, 0);
+        pthread_mutex_unlock(&pool->fd_lock);
+        rc = dir_open(&dr, AT_FDCWD, t->path);
+    }
+    if (t->parent) handle_release(pool, t->parent, parent_fd != -1);
+    t->parent = NULL;
+
+    if (rc == -1)
+    {
+        if (asprintf(&t->err, "Cannot open directory: %s\n", t->path) == -1)
+            t->err = NULL;
+    }
+    else
+    {
+        out_init_mem(&t->out);
+        print_dir_header(&t->out, t->path);
+
+        NameList subdirs = { NULL, 0, 0 };
+        list_directory(&dr, &t->out, pool->long_flag, pool->horizontal_flag, &subdirs, NULL);
+        stats_dir(t->path, t0);
+
+        size_t nsub = subdirs.count;
+        if (nsub > 0)
+        {
+            t->children = calloc(nsub, sizeof(DirTask *));
+            if (!t->children)
+            {
+                perror("calloc");
+                exit(EXIT_FAILURE);
+            }
+            DirHandle *h = handle_new(pool, dr.fd, t->path, (int)nsub);
+            for (size_t i = 0; i < nsub; i++)
+            {
+                DirTask *c = calloc(1, sizeof(DirTask));
+                if (!c)
+                {
+                    perror("calloc");
+                    exit(EXIT_FAILURE);
+                }
+                c->parent = h;
+                c->name = subdirs.names[i];     /* ownership moves to the task */
+                c->path = join_path(t->path, c->name);
+                t->children[t->nchildren++] = c;
+            }
+            subdirs.count = 0;
+            /* Push in reverse so the owner pops them in listing order */
+            for (size_t i = t->nchildren; i-- > 0; )
+                pool_submit(pool, self, t->children[i]);
+        }
+        else
+        {
+            dir_close(&dr);
+        }
+        name_list_free(&subdirs);
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    t->done = 1;
+    if (--pool->outstanding == 0) pthread_cond_broadcast(&pool->work_cv);
+    pthread_cond_broadcast(&pool->done_cv);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void *worker_main(void *arg)
+{
+    Worker *w = arg;
+    TaskPool *pool = w->pool;
+
+    for (;;)
+    {
+        DirTask *t = deque_pop(&pool->deques[w->id]);
+        for (int k = 1; !t && k < pool->nworkers; k++)
+            t = deque_steal(&pool->deques[(w->id + k) % pool->nworkers]);
+
+        if (t)
+        {
+            pthread_mutex_lock(&pool->lock);
+            pool->queued--;
+            pthread_mutex_unlock(&pool->lock);
+            run_task(pool, w->id, t);
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        while (pool->queued == 0 && pool->outstanding > 0)
+            pthread_cond_wait(&pool->work_cv, &pool->lock);
+        int finished = (pool->outstanding == 0);
+        pthread_mutex_unlock(&pool->lock);
+        if (finished) break;
+    }
+
+    free(dirbuf);
+    dirbuf = NULL;
+    dirbuf_alloc = 0;
+    arena_free(&name_arena);
+    arena_free(&entry_arena);
+#ifdef HAVE_URING
+    ring_free();
+#endif
+    return NULL;
+}
+
+/* Wait for one task and write its listing */
+static void emit_one(TaskPool *pool, DirTask *t)
+{
+    pthread_mutex_lock(&pool->lock);
+    while (!t->done)
+        pthread_cond_wait(&pool->done_cv, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+
+    out_write(&out_stdout, t->out.buf, t->out.len);
+    if (t->err)
+    {
+        out_flush(&out_stdout);
+        fputs(t->err, stderr);
+    }
+    out_free(&t->out);
+}
+
+static void task_free(DirTask *t)
+{
+    free(t->children);
+    free(t->err);
+    free(t->name);
+    free(t->path);
+    free(t);
+}
+
+/* Write a finished task and its subtree in the order the serial walk
+ * would have produced them. Depth-first on an explicit stack, like the
+ * serial walk, so deep trees cannot overflow the thread stack. */
+void emit_task(TaskPool *pool, DirTask *root)
+{
+    DirTask **stack = NULL;
+    size_t *next = NULL;
+    size_t depth = 0, cap = 0;
+
+    emit_one(pool, root);
+    for (DirTask *t = root; t; )
+    {
+        if (depth == cap)
+        {
+            cap = cap ? cap * 2 : 64;
+            stack = realloc(stack, cap * sizeof(DirTask *));
+            next = realloc(next, cap * sizeof(size_t));
+            if (!stack || !next)
+            {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+        stack[depth] = t;
+        next[depth++] = 0;
+
+        t = NULL;
+        while (depth > 0 && !t)
+        {
+            DirTask *top = stack[depth - 1];
+            if (next[depth - 1] < top->nchildren)
+            {
+                t = top->children[next[depth - 1]++];
+                if (out_format == FMT_TEXT) out_putc(&out_stdout, '\n');
+                emit_one(pool, t);
+            }
+            else
+            {
+                task_free(top);
+                depth--;
+            }
+        }
+    }
+
+    free(stack);
+    free(next);
+}
+
+/* -R with `jobs` workers: subdirectories are scanned concurrently on a
+ * work-stealing pool while the main thread streams the per-directory
+ * buffers out in serial order, so the output is byte-identical. */
+void do_ls_parallel(const char *dir, int long_flag, int horizontal_flag)
+{
+    TaskPool pool;
+    memset(&pool, 0, sizeof(pool));
+    pool.nworkers = jobs;
+    pool.long_flag = long_flag;
+    pool.horizontal_flag = horizontal_flag;
+    pool.max_fds = walk_fd_limit();
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_mutex_init(&pool.fd_lock, NULL);
+    pthread_cond_init(&pool.work_cv, NULL);
+    pthread_cond_init(&pool.done_cv, NULL);
+    pool.deques = calloc(jobs, sizeof(TaskDeque));
+    Worker *workers = calloc(jobs, sizeof(Worker));
+    pthread_t *threads = calloc(jobs, sizeof(pthread_t));
+    DirTask *root = calloc(1, sizeof(DirTask));
+    if (!pool.deques || !workers || !threads || !root)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < jobs; i++)
+        pthread_mutex_init(&pool.deques[i].lock, NULL);
+
+    root->name = strdup(dir);
+    root->path = strdup(dir);
+    pool_submit(&pool, 0, root);
+
+    for (int i = 0; i < jobs; i++)
+    {
+        workers[i].pool = &pool;
+        workers[i].id = i;
+        if (pthread_create(&threads[i], NULL, worker_main, &workers[i]) != 0)
+        {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    emit_task(&pool, root);
+
+    for (int i = 0; i < jobs; i++)
+        pthread_join(threads[i], NULL);
+    for (int i = 0; i < jobs; i++)
+    {
+        pthread_mutex_destroy(&pool.deques[i].lock);
+        free(pool.deques[i].items);
+    }
+    pthread_cond_destroy(&pool.done_cv);
+    pthread_cond_destroy(&pool.work_cv);
+    pthread_mutex_destroy(&pool.fd_lock);
+    pthread_mutex_destroy(&pool.lock);
+    free(pool.deques);
+    free(workers);
+    free(threads);
+}
+
+/* ---------- --stats Instrumentation ---------- */
+
+/* Monotonic nanoseconds, or 0 without --stats so callers skip the clock */
+uint64_t stats_clock(void)
+{
+    if (!stats_enabled) return 0;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/* Charge the time since the last switch to this thread's current phase
+ * and make `phase` current. Returns the phase to restore on leave. */
+int stats_enter(int phase)
+{
+    if (!stats_enabled) return -1;
+    uint64_t now = stats_clock();
+    int prev = stats_phase;
+    if (prev >= 0)
+        __atomic_fetch_add(&stats.phase_ns[prev], now - stats_phase_start, __ATOMIC_RELAXED);
+    stats_phase = phase;
+    stats_phase_start = now;
+    return prev;
+}
+
+void stats_leave(int prev)
+{
+    if (!stats_enabled) return;
+    uint64_t now = stats_clock();
+    if (stats_phase >= 0)
+        __atomic_fetch_add(&stats.phase_ns[stats_phase], now - stats_phase_start, __ATOMIC_RELAXED);
+    stats_phase = prev;
+    stats_phase_start = now;
+}
+
+void stats_count(int call, uint64_t n)
+{
+    if (!stats_enabled) return;
+    __atomic_fetch_add(&stats.calls[call], n, __ATOMIC_RELAXED);
+}
+
+/* Record `n` operations that together took the time since `since` */
+void stats_latency(uint64_t *hist, uint64_t since, uint64_t n)
+{
+    if (!stats_enabled || n == 0) return;
+    uint64_t ns = (stats_clock() - since) / n;
+    int b = 63 - __builtin_clzll(ns | 1);
+    if (b >= HIST_BUCKETS) b = HIST_BUCKETS - 1;
+    __atomic_fetch_add(&hist[b], n, __ATOMIC_RELAXED);
+}
+
+/* Offer one directory's open+read+stat+render time to the slowest list */
+void stats_dir(const char *path, uint64_t since)
+{
+    if (!stats_enabled) return;
+    uint64_t ns = stats_clock() - since;
+
+    pthread_mutex_lock(&stats_lock);
+    if (!stats.slow)
+    {
+        stats.slow = calloc(stats.maxslow, sizeof(SlowDir));
+        if (!stats.slow)
+        {
+            perror("calloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (stats.nslow < stats.maxslow || ns > stats.slow[stats.nslow - 1].ns)
+    {
+        size_t i = stats.nslow < stats.maxslow ? stats.nslow++ : stats.nslow - 1;
+        free(stats.slow[i].path);
+        for (; i > 0 && stats.slow[i - 1].ns < ns; i--)
+            stats.slow[i] = stats.slow[i - 1];
+        stats.slow[i].ns = ns;
+        stats.slow[i].path = strdup(path);
+    }
+    pthread_mutex_unlock(&stats_lock);
+}
+
+/* Human-readable duration: 950ns, 12.3us, 4.56ms, 1.23s */
+static void stats_fmt_ns(char *buf, size_t n, uint64_t ns)
+{
+    if (ns < 1000) snprintf(buf, n, "%lluns", (unsigned long long)ns);
+    else if (ns < 1000000) snprintf(buf, n, "%.1fus", ns / 1e3);
+    else if (ns < 1000000000) snprintf(buf, n, "%.2fms", ns / 1e6);
+    else snprintf(buf, n, "%.2fs", ns / 1e9);
+}
+
+static void stats_print_hist(const char *title, const uint64_t *hist)
+{
+    uint64_t total = 0, peak = 0;
+    for (int b = 0; b < HIST_BUCKETS; b++)
+    {
+        total += hist[b];
+        if (hist[b] > peak) peak = hist[b];
+    }
+    fprintf(stderr, "%s latency (%llu calls):\n", title, (unsigned long long)total);
+    for (int b = 0; b < HIST_BUCKETS; b++)
+    {
+        if (!hist[b]) continue;
+        char lo[16], hi[16];
+        stats_fmt_ns(lo, sizeof(lo), b == 0 ? 0 : 1ull << b);
+        stats_fmt_ns(hi, sizeof(hi), 2ull << b);
+        int bar = (int)(hist[b] * 40 / peak);
+        fprintf(stderr, "  %8s - %-8s %10llu  %.*s\n", lo, hi,
+                (unsigned long long)hist[b], bar > 0 ? bar : 1,
+                "########################################");
+    }
+}
+
+/* Write the --stats report to stderr once the listing is flushed */
+void stats_report(void)
+{
+    static const char *phase_names[PH_COUNT] = { "read", "stat", "sort", "render", "write" };
+    static const char *call_names[SC_COUNT] = {
+        "openat", "getdents64", "statx", "fstatat", "io_uring_enter",
+        "write", "close", "getpwuid/getgrgid"
+    };
+    if (!stats_enabled) return;
+
+    char buf[16];
+    uint64_t wall = stats_clock() - stats.start;
+    stats_fmt_ns(buf, sizeof(buf), wall);
+    fprintf(stderr, "--- ls stats: %s wall ---\n", buf);
+
+    fprintf(stderr, "phases (summed over threads):\n");
+    for (int i = 0; i < PH_COUNT; i++)
+    {
+        stats_fmt_ns(buf, sizeof(buf), stats.phase_ns[i]);
+        fprintf(stderr, "  %-8s %10s\n", phase_names[i], buf);
+    }
+
+    fprintf(stderr, "calls:\n");
+    for (int i = 0; i < SC_COUNT; i++)
+        fprintf(stderr, "  %-18s %10llu\n", call_names[i], (unsigned long long)stats.calls[i]);
+
+    stats_print_hist("lstat", stats.hist_stat);
+    stats_print_hist("opendir", stats.hist_open);
+
+    fprintf(stderr, "slowest directories:\n");
+    for (size_t i = 0; i < stats.nslow; i++)
+    {
+        stats_fmt_ns(buf, sizeof(buf), stats.slow[i].ns);
+        fprintf(stderr, "  %10s  %s\n", buf, stats.slow[i].path ? stats.slow[i].path : "?");
+        free(stats.slow[i].path);
+    }
+    free(stats.slow);
+    stats.slow = NULL;
+}
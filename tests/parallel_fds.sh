@@ -0,0 +1,39 @@
+#!/bin/sh
+# -j -R must list exactly what the serial -R walk lists, even when the
+# descriptor limit is far below the depth of a branching tree: a pending
+# sibling at every level keeps each ancestor's descriptor wanted.
+#
+# Usage: parallel_fds.sh LS_BINARY
+LS=${1:?usage: parallel_fds.sh LS_BINARY}
+case $LS in /*) ;; *) LS="$PWD/$LS" ;; esac
+
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+dir="$TMP/tree"
+i=0
+while [ $i -lt 200 ]; do
+    mkdir -p "$dir/side" "$dir/down"
+    : > "$dir/side/file"
+    dir="$dir/down"
+    i=$((i + 1))
+done
+
+rc=0
+for limit in 64 16; do
+    for jobs in 2 4 8; do
+        (
+            ulimit -n $limit
+            cd "$TMP" || exit 1
+            "$LS" -R tree > serial.out 2>&1
+            "$LS" -j$jobs -R tree > parallel.out 2>&1
+        )
+        if ! cmp -s "$TMP/serial.out" "$TMP/parallel.out"; then
+            echo "parallel_fds: -j$jobs -R differs from -R at ulimit -n $limit"
+            diff "$TMP/serial.out" "$TMP/parallel.out" | head -10
+            rc=1
+        fi
+    done
+done
+[ $rc -eq 0 ] && echo "parallel_fds: ok"
+exit $rc